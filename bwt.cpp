@@ -24,6 +24,8 @@
 
 #include <condition_variable>
 
+#include <sys/mman.h>
+
 #include "bwt.h"
 
 namespace bwtmerge
@@ -31,6 +33,99 @@ namespace bwtmerge
 
 //------------------------------------------------------------------------------
 
+FastLayout::FastLayout()
+{
+  this->data = 0; this->blocks = 0;
+}
+
+FastLayout::FastLayout(const FastLayout& source)
+{
+  this->data = 0; this->blocks = 0;
+  this->copy(source);
+}
+
+FastLayout::FastLayout(FastLayout&& source)
+{
+  this->data = 0; this->blocks = 0;
+  *this = std::move(source);
+}
+
+FastLayout::~FastLayout()
+{
+  this->clear();
+}
+
+void
+FastLayout::copy(const FastLayout& source)
+{
+  this->allocate(source.size());
+  if(!(this->empty())) { std::memcpy(this->data, source.data, this->bytes()); }
+}
+
+void
+FastLayout::swap(FastLayout& source)
+{
+  if(this != &source)
+  {
+    std::swap(this->data, source.data);
+    std::swap(this->blocks, source.blocks);
+  }
+}
+
+FastLayout&
+FastLayout::operator=(const FastLayout& source)
+{
+  if(this != &source) { this->copy(source); }
+  return *this;
+}
+
+FastLayout&
+FastLayout::operator=(FastLayout&& source)
+{
+  if(this != &source)
+  {
+    this->clear();
+    this->swap(source);
+  }
+  return *this;
+}
+
+void
+FastLayout::allocate(size_type n)
+{
+  this->clear();
+  if(n == 0) { return; }
+
+  // Anonymous mappings are page-aligned, so each record starts at a cache line boundary.
+  void* ptr = mmap(0, n * sizeof(Block), PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+  if(ptr == MAP_FAILED)
+  {
+    std::cerr << "FastLayout::allocate(): Cannot allocate " << n << " blocks" << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  this->data = (Block*)ptr; this->blocks = n;
+}
+
+void
+FastLayout::clear()
+{
+  if(this->data != 0) { munmap((void*)(this->data), this->bytes()); }
+  this->data = 0; this->blocks = 0;
+}
+
+//------------------------------------------------------------------------------
+
+void
+BlockDirectory::clear()
+{
+  sdsl::util::clear(this->coarse_starts);
+  sdsl::util::clear(this->relative_starts);
+  sdsl::util::clear(this->sampled_blocks);
+  this->shift = 0;
+}
+
+//------------------------------------------------------------------------------
+
 BWT::BWT()
 {
 }
@@ -61,6 +156,9 @@ BWT::copy(const BWT& source)
   this->block_rank = source.block_rank;
   this->block_select = source.block_select;
   this->setVectors();
+
+  this->fast = source.fast;
+  this->directory = source.directory;
 }
 
 void
@@ -81,6 +179,8 @@ BWT::swap(BWT& source)
     this->block_boundaries.swap(source.block_boundaries);
     sdsl::util::swap_support(this->block_rank, source.block_rank, &(this->block_boundaries), &(source.block_boundaries));
     sdsl::util::swap_support(this->block_select, source.block_select, &(this->block_boundaries), &(source.block_boundaries));
+    this->fast.swap(source.fast);
+    std::swap(this->directory, source.directory);
   }
 }
 
@@ -104,6 +204,9 @@ BWT::operator=(BWT&& source)
     this->block_rank = std::move(source.block_rank);
     this->block_select = std::move(source.block_select);
     this->setVectors();
+
+    this->fast = std::move(source.fast);
+    this->directory = std::move(source.directory);
   }
   return *this;
 }
@@ -130,7 +233,7 @@ BWT::serialize(std::ostream& out, sdsl::structure_tree_node* v, std::string name
 }
 
 void
-BWT::load(std::istream& in)
+BWT::load(std::istream& in, int fd)
 {
   this->header.load(in);
   if(!(this->header.check()))
@@ -138,8 +241,14 @@ BWT::load(std::istream& in)
     std::cerr << "BWT::load(): Invalid header!" << std::endl;
     std::exit(EXIT_FAILURE);
   }
+  if(this->header.blockSize() != Run::BLOCK_SIZE)
+  {
+    std::cerr << "BWT::load(): The BWT uses " << this->header.blockSize() << "-byte blocks, but this build uses "
+              << Run::BLOCK_SIZE << "-byte blocks (see RLE_BLOCK_SIZE)" << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
 
-  this->data.load(in);
+  this->data.load(in, fd);
   for(size_type c = 0; c < SIGMA; c++) { this->samples[c].load(in); }
 
   this->block_boundaries.load(in);
@@ -212,6 +321,128 @@ mergeRA(RankArray& ra, RABuffer& ra_buffer)
   ra.close();
 }
 
+/*
+  Segments of the rank array for the partitioned merge. The worker threads merge value
+  ranges of the rank array into compressed in-memory segments, while the producer thread
+  streams the segments to the RABuffer in order. At most window segments after the one
+  being streamed are kept in memory.
+*/
+struct RASegments
+{
+  const static size_type PARTITIONS_PER_THREAD = 4;
+
+  std::mutex                       mtx;
+  std::condition_variable          changed;
+  std::vector<RLArray<BlockArray>> segments;
+  std::vector<bool>                ready;
+  size_type                        streamed;  // The segment being streamed.
+  size_type                        window;
+
+  RASegments(size_type n, size_type _window) :
+    segments(n), ready(n, false), streamed(0), window(_window)
+  {
+  }
+};
+
+void
+mergeSegments(RankArray& ra, const std::vector<size_type>& bounds, RASegments& segments,
+  size_type first, size_type step)
+{
+  for(size_type p = first; p + 1 < bounds.size(); p += step)
+  {
+    {
+      std::unique_lock<std::mutex> lock(segments.mtx);
+      segments.changed.wait(lock, [&]() { return (p <= segments.streamed + segments.window); });
+    }
+
+    RLArray<BlockArray> segment;
+    RankArray view(ra, bounds[p], bounds[p + 1]);
+    RunBuffer run_buffer;
+    size_type prev = 0;
+    for(view.open(); !(view.end()); ++view)
+    {
+      if(run_buffer.add(*view)) { segment.addRun(run_buffer.run, prev); }
+    }
+    run_buffer.flush();
+    if(run_buffer.run.second > 0) { segment.addRun(run_buffer.run, prev); }
+    view.close();
+
+    std::lock_guard<std::mutex> lock(segments.mtx);
+    segments.segments[p].swap(segment); segments.ready[p] = true;
+    segments.changed.notify_all();
+  }
+}
+
+/*
+  Partitioned version of mergeRA(). The value range is split at sampled values, and the
+  partitions after the first one are merged by threads - 1 worker threads.
+*/
+void
+mergeRA(RankArray& ra, RABuffer& ra_buffer, size_type threads)
+{
+  std::vector<size_type> bounds;
+  if(threads > 1) { bounds = ra.partition(threads * RASegments::PARTITIONS_PER_THREAD); }
+  if(bounds.size() <= 2) { mergeRA(ra, ra_buffer); return; }
+
+  size_type parts = bounds.size() - 1, workers = std::min(threads - 1, parts - 1);
+  RASegments segments(parts, workers);
+  std::vector<std::thread> worker_threads;
+  for(size_type i = 0; i < workers; i++)
+  {
+    worker_threads.push_back(std::thread(mergeSegments, std::ref(ra), std::cref(bounds),
+      std::ref(segments), i + 1, workers));
+  }
+
+#ifdef VERBOSE_STATUS_INFO
+  {
+    std::lock_guard<std::mutex> lock(Parallel::stderr_access);
+    std::cerr << "mergeRA(): Merging the rank array in " << parts << " partitions with "
+              << workers << " worker threads" << std::endl;
+  }
+#endif
+
+  std::vector<RankArray::run_type> out_buffer;
+  out_buffer.reserve(RABuffer::BUFFER_SIZE);
+  RunBuffer run_buffer;
+
+  // The first partition is merged directly.
+  {
+    RankArray view(ra, bounds[0], bounds[1]);
+    for(view.open(); !(view.end()); ++view)
+    {
+      if(run_buffer.add(*view))
+      {
+        out_buffer.push_back(run_buffer.run);
+        if(out_buffer.size() >= RABuffer::BUFFER_SIZE) { ra_buffer.add(out_buffer, false); }
+      }
+    }
+    view.close();
+  }
+
+  for(size_type p = 1; p < parts; p++)
+  {
+    RLArray<BlockArray> segment;
+    {
+      std::unique_lock<std::mutex> lock(segments.mtx);
+      segments.changed.wait(lock, [&]() { return segments.ready[p]; });
+      segment.swap(segments.segments[p]); segments.streamed = p;
+      segments.changed.notify_all();
+    }
+    for(RLIterator<BlockArray> iter(segment); !(iter.end()); ++iter)
+    {
+      if(run_buffer.add(*iter))
+      {
+        out_buffer.push_back(run_buffer.run);
+        if(out_buffer.size() >= RABuffer::BUFFER_SIZE) { ra_buffer.add(out_buffer, false); }
+      }
+    }
+  }
+  run_buffer.flush(); out_buffer.push_back(run_buffer.run);
+  ra_buffer.add(out_buffer, true);
+
+  for(size_type i = 0; i < worker_threads.size(); i++) { worker_threads[i].join(); }
+}
+
 void
 mergeBWT(BWT& a, BWT& b, BWT& result, sdsl::int_vector<64>& counts, RABuffer& ra_buffer)
 {
@@ -281,21 +512,341 @@ mergeBWT(BWT& a, BWT& b, BWT& result, sdsl::int_vector<64>& counts, RABuffer& ra
   counts[out_buffer.run.first] += out_buffer.run.second;
 }
 
+/*
+  Partitioned interleave. The rank array is split into value ranges, which correspond to
+  ranges of positions in a. Each segment of the merged BWT is interleaved by a worker
+  thread into its own RLESegment. The main thread places the segments in the result in
+  order, and the segments are then written to the result in parallel.
+*/
+struct BWTSegment
+{
+  size_type  a_start, a_limit, a_rle_pos, b_rle_pos;
+  range_type a_run, b_run;  // The remaining parts of the runs at the starting positions.
+
+  RLESegment           rle;
+  sdsl::int_vector<64> counts;
+  bool                 ready;
+
+  BWTSegment() :
+    a_start(0), a_limit(0), a_rle_pos(0), b_rle_pos(0), a_run(0, 0), b_run(0, 0),
+    counts(BWT::SIGMA, 0), ready(false)
+  {
+  }
+
+  inline void addRun(range_type run)
+  {
+    this->rle.addRun(run);
+    this->counts[run.first] += run.second;
+  }
+};
+
+struct BWTSegments
+{
+  const static size_type PARTITIONS_PER_THREAD = 4;
+
+  std::mutex              mtx;
+  std::condition_variable finished;
+  std::vector<size_type>  bounds;
+  std::vector<BWTSegment> segments;
+};
+
+/*
+  Returns the remaining part of the run containing position i and sets rle_pos to point
+  past the run.
+*/
+range_type
+seekRun(const BWT& bwt, size_type i, size_type& rle_pos)
+{
+  if(i >= bwt.size()) { rle_pos = bwt.bytes(); return range_type(0, 0); }
+
+  size_type block = bwt.block_rank(i);
+  rle_pos = block * BWT::SAMPLE_RATE;
+  size_type seq_pos = (block > 0 ? bwt.block_select(block) + 1 : 0);
+  while(true)
+  {
+    range_type run = Run::read(bwt.data, rle_pos);
+    seq_pos += run.second;  // The start of the next run.
+    if(seq_pos > i) { run.second = seq_pos - i; return run; }
+  }
+}
+
+/*
+  Reads the next run and releases the memory blocks that are no longer needed. Blocks up to
+  first_block may still be needed by the previous segments.
+*/
+inline range_type
+readRun(BWT& bwt, size_type& rle_pos, size_type first_block)
+{
+  range_type run = Run::read(bwt.data, rle_pos);
+  size_type block = BlockArray::block(rle_pos);
+  if(block > first_block + 1) { bwt.data.clear(block - 1); }
+  return run;
+}
+
+void
+interleaveSegments(ParallelLoop& loop, BWT& a, BWT& b, RankArray& ra, BWTSegments& segments)
+{
+  for(range_type range = loop.next(); !(Range::empty(range)); range = loop.next())
+  {
+    for(size_type p = range.first; p <= range.second; p++)
+    {
+      BWTSegment& segment = segments.segments[p];
+      size_type a_first_block = BlockArray::block(segment.a_rle_pos);
+      size_type b_first_block = BlockArray::block(segment.b_rle_pos);
+      size_type a_rle_pos = segment.a_rle_pos, b_rle_pos = segment.b_rle_pos;
+      size_type a_seq_pos = segment.a_start;
+      range_type a_run = segment.a_run, b_run = segment.b_run;
+      RunBuffer out_buffer;
+
+      RankArray view(ra, segments.bounds[p], segments.bounds[p + 1]);
+      for(view.open(); ; ++view)
+      {
+        RankArray::run_type curr = (view.end() ? RankArray::run_type(segment.a_limit, 0) : *view);
+        while(a_seq_pos < curr.first)
+        {
+          if(a_run.second == 0) { a_run = readRun(a, a_rle_pos, a_first_block); }
+          size_type length = std::min(curr.first - a_seq_pos, a_run.second);
+          if(out_buffer.add(a_run.first, length)) { segment.addRun(out_buffer.run); }
+          a_run.second -= length; a_seq_pos += length;
+        }
+        while(curr.second > 0)
+        {
+          if(b_run.second == 0) { b_run = readRun(b, b_rle_pos, b_first_block); }
+          size_type length = std::min(curr.second, b_run.second);
+          if(out_buffer.add(b_run.first, length)) { segment.addRun(out_buffer.run); }
+          b_run.second -= length; curr.second -= length;
+        }
+        if(view.end()) { break; }
+      }
+      view.close();
+      out_buffer.flush();
+      segment.rle.tail = out_buffer.run;
+      segment.counts[segment.rle.tail.first] += segment.rle.tail.second;
+
+      std::lock_guard<std::mutex> lock(segments.mtx);
+      segment.ready = true;
+      segments.finished.notify_all();
+    }
+  }
+}
+
+void
+writeSegments(ParallelLoop& loop, BWTSegments& segments, BWT& result)
+{
+  for(range_type range = loop.next(); !(Range::empty(range)); range = loop.next())
+  {
+    for(size_type p = range.first; p <= range.second; p++) { segments.segments[p].rle.write(result.data); }
+  }
+}
+
+/*
+  Appends the segments to the result in order. The main thread only places the segments,
+  while they are written in parallel.
+*/
+void
+appendSegments(BWTSegments& segments, BWT& result, sdsl::int_vector<64>& counts, size_type threads)
+{
+  RunBuffer out_buffer;
+  ByteCounter pos(0);
+#ifdef VERBOSE_STATUS_INFO
+  double serial_seconds = 0.0;
+#endif
+  for(size_type p = 0; p < segments.segments.size(); p++)
+  {
+    BWTSegment& segment = segments.segments[p];
+    {
+      std::unique_lock<std::mutex> lock(segments.mtx);
+      segments.finished.wait(lock, [&segment]() { return segment.ready; });
+    }
+#ifdef VERBOSE_STATUS_INFO
+    double segment_start = readTimer();
+#endif
+    for(size_type c = 0; c < BWT::SIGMA; c++) { counts[c] += segment.counts[c]; }
+    segment.rle.place(out_buffer, pos);
+#ifdef VERBOSE_STATUS_INFO
+    serial_seconds += readTimer() - segment_start;
+#endif
+  }
+  result.data.resize(pos.size());
+
+#ifdef VERBOSE_STATUS_INFO
+  double write_start = readTimer();
+#endif
+  {
+    ParallelLoop loop(0, segments.segments.size(), segments.segments.size(), threads);
+    loop.execute(writeSegments, std::ref(segments), std::ref(result));
+  }
+
+  // Flush the buffer.
+  out_buffer.flush();
+  if(out_buffer.run.second > 0) { Run::write(result.data, out_buffer.run); }
+
+#ifdef VERBOSE_STATUS_INFO
+  std::cerr << "bwt_merge: Segments placed in " << serial_seconds << " seconds and written in "
+            << (readTimer() - write_start) << " seconds" << std::endl;
+#endif
+}
+
+/*
+  Determines the starting positions of the segments. This must be done before destroying
+  the rank/select structures of the inputs.
+*/
+void
+initSegments(BWT& a, BWT& b, RankArray& ra, const std::vector<size_type>& bounds, BWTSegments& segments)
+{
+  segments.bounds = bounds;
+  segments.segments = std::vector<BWTSegment>(bounds.size() - 1);
+  for(size_type p = 0; p < segments.segments.size(); p++)
+  {
+    BWTSegment& segment = segments.segments[p];
+    RankArray view(ra, bounds[p], bounds[p + 1]);
+    view.open(); view.close();
+    segment.a_start = bounds[p];
+    segment.a_limit = std::min(bounds[p + 1], a.size());
+    segment.a_run = seekRun(a, segment.a_start, segment.a_rle_pos);
+    segment.b_run = seekRun(b, view.values_before, segment.b_rle_pos);
+  }
+}
+
+void
+mergeBWT(BWT& a, BWT& b, BWT& result, sdsl::int_vector<64>& counts, RankArray& ra,
+  BWTSegments& segments, size_type threads)
+{
+#ifdef VERBOSE_STATUS_INFO
+  std::cerr << "bwt_merge: Interleaving the BWTs in " << segments.segments.size() << " segments" << std::endl;
+#endif
+
+  {
+    ParallelLoop loop(0, segments.segments.size(), segments.segments.size(), threads);
+    loop.execute(interleaveSegments, std::ref(a), std::ref(b), std::ref(ra), std::ref(segments));
+    appendSegments(segments, result, counts, threads);
+  }
+  a.data.clear(); b.data.clear();
+}
+
+/*
+  A source of runs for the single-pass k-way interleave. The base source reads the runs
+  of its BWT. Every other source interleaves the runs of its BWT with the runs from the
+  lower source according to the rank array it gets from the buffer.
+*/
+struct RunSource
+{
+  BWT*       bwt;
+  size_type  rle_pos;
+  range_type run;
+
+  RunSource*                      lower;
+  RABuffer*                       ra_buffer;
+  std::vector<RABuffer::run_type> in_buffer;
+  size_type                       ra_pos;
+  bool                            ra_finished;
+  RankArray::run_type             curr;
+  size_type                       seq_pos;  // Characters from the lower source.
+
+  RunSource() :
+    bwt(0), rle_pos(0), run(0, 0),
+    lower(0), ra_buffer(0), ra_pos(0), ra_finished(false), curr(0, 0), seq_pos(0)
+  {
+  }
+
+  void init(BWT* _bwt, RunSource* _lower, RABuffer* _ra_buffer)
+  {
+    this->bwt = _bwt; this->lower = _lower; this->ra_buffer = _ra_buffer;
+    if(this->ra_buffer != 0) { this->in_buffer.reserve(RABuffer::BUFFER_SIZE); }
+  }
+
+  /*
+    Returns the next run of at most max_length characters. Length 0 means that the source
+    has been exhausted.
+  */
+  range_type next(size_type max_length)
+  {
+    if(this->lower == 0) { return this->read(max_length); }
+
+    while(this->curr.second == 0 && this->curr.first != ~(size_type)0) { this->nextRA(); }
+    if(this->seq_pos < this->curr.first)
+    {
+      range_type result = this->lower->next(std::min(max_length, this->curr.first - this->seq_pos));
+      this->seq_pos += result.second;
+      return result;
+    }
+    range_type result = this->read(std::min(max_length, this->curr.second));
+    this->curr.second -= result.second;
+    return result;
+  }
+
+  range_type read(size_type max_length)
+  {
+    if(this->run.second == 0)
+    {
+      if(this->rle_pos >= this->bwt->bytes()) { return range_type(0, 0); }
+      this->run = Run::read(this->bwt->data, this->rle_pos); this->bwt->data.clearUntil(this->rle_pos);
+    }
+    range_type result(this->run.first, std::min(this->run.second, max_length));
+    this->run.second -= result.second;
+    return result;
+  }
+
+  void nextRA()
+  {
+    while(this->ra_pos >= this->in_buffer.size())
+    {
+      if(this->ra_finished) { this->curr = RankArray::run_type(~(size_type)0, 0); return; }
+      this->in_buffer.clear();
+      this->ra_buffer->get(this->in_buffer, this->ra_finished);
+      this->ra_pos = 0;
+    }
+    this->curr = this->in_buffer[this->ra_pos]; this->ra_pos++;
+  }
+};
+
+void
+mergeBWT(RunSource& source, BWT& result, sdsl::int_vector<64>& counts)
+{
+  RunBuffer out_buffer;
+  while(true)
+  {
+    range_type run = source.next(~(size_type)0);
+    if(run.second == 0) { break; }
+    if(out_buffer.add(run))
+    {
+      Run::write(result.data, out_buffer.run);
+      counts[out_buffer.run.first] += out_buffer.run.second;
+    }
+  }
+
+  // Flush the buffer.
+  out_buffer.flush();
+  Run::write(result.data, out_buffer.run);
+  counts[out_buffer.run.first] += out_buffer.run.second;
+}
+
 //------------------------------------------------------------------------------
 
-BWT::BWT(BWT& a, BWT& b, RankArray& ra)
+BWT::BWT(BWT& a, BWT& b, RankArray& ra, size_type threads)
 {
 #ifdef VERBOSE_STATUS_INFO
   double start = readTimer();
 #endif
 
-  a.destroy(); b.destroy();
-  RABuffer ra_buffer;
   sdsl::int_vector<64> counts(SIGMA, 0);
-
-  std::thread producer(mergeRA, std::ref(ra), std::ref(ra_buffer));
-  mergeBWT(a, b, *this, counts, ra_buffer);
-  producer.join();
+  std::vector<size_type> bounds;
+  if(threads > 1) { bounds = ra.partition(threads * BWTSegments::PARTITIONS_PER_THREAD); }
+  if(bounds.size() > 2)
+  {
+    BWTSegments segments;
+    initSegments(a, b, ra, bounds, segments);
+    a.destroy(); b.destroy();
+    mergeBWT(a, b, *this, counts, ra, segments, threads);
+  }
+  else
+  {
+    a.destroy(); b.destroy();
+    RABuffer ra_buffer;
+    std::thread producer([&]() { mergeRA(ra, ra_buffer, threads); });
+    mergeBWT(a, b, *this, counts, ra_buffer);
+    producer.join();
+  }
 
 #ifdef VERBOSE_STATUS_INFO
   double midpoint = readTimer();
@@ -305,7 +856,7 @@ BWT::BWT(BWT& a, BWT& b, RankArray& ra)
   this->header.sequences = a.sequences() + b.sequences();
   this->header.bases = a.size() + b.size();
   this->header.setOrder(a.header.order());
-  this->build(counts);
+  this->build(counts, threads);
 
 #ifdef VERBOSE_STATUS_INFO
   double seconds = readTimer() - midpoint;
@@ -313,22 +864,65 @@ BWT::BWT(BWT& a, BWT& b, RankArray& ra)
 #endif
 }
 
-//------------------------------------------------------------------------------
-
-size_type
-BWT::rank(size_type i, comp_type c) const
+BWT::BWT(std::vector<BWT*>& inputs, std::vector<RankArray>& ra, size_type threads)
 {
-  if(c >= SIGMA) { return 0; }
-  if(i > this->size()) { i = this->size(); }
+#ifdef VERBOSE_STATUS_INFO
+  double start = readTimer();
+#endif
 
-  size_type block = this->block_rank(i);
-  size_type res = this->samples[c].sum(block);
-  size_type rle_pos = block * SAMPLE_RATE;
-  size_type seq_pos = (block > 0 ? this->block_select(block) + 1 : 0);
+  for(size_type i = 0; i < inputs.size(); i++) { inputs[i]->destroy(); }
+  std::vector<RABuffer> ra_buffers(ra.size());
+  std::vector<RunSource> sources(inputs.size());
+  sdsl::int_vector<64> counts(SIGMA, 0);
+
+  sources[0].init(inputs[0], 0, 0);
+  for(size_type i = 1; i < inputs.size(); i++)
+  {
+    sources[i].init(inputs[i], &(sources[i - 1]), &(ra_buffers[i - 1]));
+  }
 
+  std::vector<std::thread> producers;
+  for(size_type i = 0; i < ra.size(); i++)
+  {
+    size_type producer_threads = std::max(threads / ra.size(), (size_type)1);
+    producers.push_back(std::thread([&, i, producer_threads]() { mergeRA(ra[i], ra_buffers[i], producer_threads); }));
+  }
+  mergeBWT(sources.back(), *this, counts);
+  for(size_type i = 0; i < producers.size(); i++) { producers[i].join(); }
+
+#ifdef VERBOSE_STATUS_INFO
+  double midpoint = readTimer();
+  std::cerr << "bwt_merge: " << inputs.size() << " BWTs merged in " << (midpoint - start) << " seconds" << std::endl;
+#endif
+
+  for(size_type i = 0; i < inputs.size(); i++)
+  {
+    this->header.sequences += inputs[i]->sequences();
+    this->header.bases += inputs[i]->size();
+  }
+  this->header.setOrder(inputs[0]->header.order());
+  this->build(counts, threads);
+
+#ifdef VERBOSE_STATUS_INFO
+  double seconds = readTimer() - midpoint;
+  std::cerr << "bwt_merge: rank/select built in " << seconds << " seconds" << std::endl;
+#endif
+}
+
+//------------------------------------------------------------------------------
+
+/*
+  Scanning kernels for a single RLE block starting at sequence position seq_pos. The block
+  can be given either as a pointer into the BlockArray or as a fast layout record.
+*/
+
+inline size_type
+rankInBlock(const Run::code_type* rle, size_type seq_pos, size_type i, comp_type c)
+{
+  size_type res = 0, rle_pos = 0;
   while(seq_pos < i)
   {
-    range_type run = Run::read(this->data, rle_pos);
+    range_type run = Run::read(rle, rle_pos);
     seq_pos += run.second;  // The starting position of the next run.
     if(run.first == c)
     {
@@ -336,30 +930,110 @@ BWT::rank(size_type i, comp_type c) const
       if(seq_pos > i) { res -= seq_pos - i; }
     }
   }
-
   return res;
 }
 
-void
-BWT::ranks(size_type i, ranks_type& results) const
+// Adds the ranks within the block to the results.
+inline void
+ranksInBlock(const Run::code_type* rle, size_type seq_pos, size_type i, BWT::ranks_type& results)
 {
-  if(i > this->size()) { i = this->size(); }
-
-  size_type block = this->block_rank(i);
-  for(size_type c = 1; c < SIGMA; c++) { results[c] = this->samples[c].sum(block); }
-  size_type rle_pos = block * SAMPLE_RATE;
-  size_type seq_pos = (block > 0 ? this->block_select(block) + 1 : 0);
-
-  size_type prev = 0;
+  size_type rle_pos = 0, prev = 0;
   while(seq_pos < i)
   {
-    range_type run = Run::read(this->data, rle_pos);
+    range_type run = Run::read(rle, rle_pos);
     seq_pos += run.second;  // The starting position of the next run.
     results[run.first] += run.second; prev = run.first;
   }
   results[prev] -= seq_pos - i;
 }
 
+// The block must contain the (i - count)th occurrence of c after seq_pos.
+inline size_type
+selectInBlock(const Run::code_type* rle, size_type seq_pos, size_type count, size_type i, comp_type c)
+{
+  size_type rle_pos = 0;
+  while(true)
+  {
+    range_type run = Run::read(rle, rle_pos);
+    seq_pos += run.second - 1;  // The last position in the run.
+    if(run.first == c)
+    {
+      count += run.second;  // Number of c's up to the end of the run.
+      if(count >= i) { return seq_pos + i - count; }
+    }
+    seq_pos++;  // Move to the first position in the next run.
+  }
+}
+
+inline comp_type
+accessInBlock(const Run::code_type* rle, size_type seq_pos, size_type i)
+{
+  size_type rle_pos = 0;
+  while(true)
+  {
+    range_type run = Run::read(rle, rle_pos);
+    seq_pos += run.second;  // The start of the next run.
+    if(seq_pos > i) { return run.first; }
+  }
+}
+
+// Returns (rank(i, seq[i]) within the block, seq[i]).
+inline range_type
+inverseSelectInBlock(const Run::code_type* rle, size_type seq_pos, size_type i)
+{
+  range_type run(0, 0);
+  size_type rle_pos = 0;
+  size_type ranks[Run::SIGMA] = {};
+  while(seq_pos <= i)
+  {
+    run = Run::read(rle, rle_pos);
+    seq_pos += run.second;  // The starting position of the next run.
+    ranks[run.first] += run.second; // Number of c's before the next run.
+  }
+  return range_type(ranks[run.first] - (seq_pos - i), run.first);
+}
+
+//------------------------------------------------------------------------------
+
+size_type
+BWT::rank(size_type i, comp_type c) const
+{
+  if(c >= SIGMA) { return 0; }
+  if(i > this->size()) { i = this->size(); }
+
+  size_type block = this->findBlock(i);
+  if(this->hasFast())
+  {
+    const FastLayout::Block& record = this->fast[block];
+    return record.ranks[c] + rankInBlock(record.rle, record.start, i, c);
+  }
+
+  size_type res = this->samples[c].sum(block);
+  size_type seq_pos = this->blockStart(block);
+  if(seq_pos >= i) { return res; }  // The block may be past the end.
+  return res + rankInBlock(this->rleBlock(block), seq_pos, i, c);
+}
+
+void
+BWT::ranks(size_type i, ranks_type& results) const
+{
+  if(i > this->size()) { i = this->size(); }
+
+  size_type block = this->findBlock(i);
+  if(this->hasFast())
+  {
+    const FastLayout::Block& record = this->fast[block];
+    for(size_type c = 1; c < SIGMA; c++) { results[c] = record.ranks[c]; }
+    ranksInBlock(record.rle, record.start, i, results);
+    return;
+  }
+
+  for(size_type c = 1; c < SIGMA; c++) { results[c] = this->samples[c].sum(block); }
+  size_type seq_pos = this->blockStart(block);
+  if(seq_pos >= i) { return; } // The block may be past the end.
+  ranksInBlock(this->rleBlock(block), seq_pos, i, results);
+}
+
 void
 BWT::ranks(range_type range, rank_ranges_type& results) const
 {
@@ -367,9 +1041,9 @@ BWT::ranks(range_type range, rank_ranges_type& results) const
   range.second = std::min(range.second, this->size() - 1);
   for(size_type c = 1; c < SIGMA; c++) { results[c] = range_type(0, 0); }
 
-  size_type block = this->block_rank(range.first);
+  size_type block = this->findBlock(range.first);
   size_type rle_pos = block * SAMPLE_RATE;
-  size_type seq_pos = (block > 0 ? this->block_select(block) + 1 : 0);
+  size_type seq_pos = this->blockStart(block);
 
   // Compute the ranks within the block until range.first.
   range_type run(0, 0);
@@ -410,20 +1084,15 @@ BWT::select(size_type i, comp_type c) const
   if(i > this->count(c)) { return this->size(); }
 
   size_type block = this->samples[c].inverse(i - 1);
-  size_type count = this->samples[c].sum(block);
-  size_type rle_pos = block * SAMPLE_RATE;
-  size_type seq_pos = (block > 0 ? this->block_select(block) + 1 : 0);
-  while(true)
+  if(this->hasFast())
   {
-    range_type run = Run::read(this->data, rle_pos);
-    seq_pos += run.second - 1;  // The last position in the run.
-    if(run.first == c)
-    {
-      count += run.second;  // Number of c's up to the end of the run.
-      if(count >= i) { return seq_pos + i - count; }
-    }
-    seq_pos++;  // Move to the first position in the next run.
+    const FastLayout::Block& record = this->fast[block];
+    return selectInBlock(record.rle, record.start, record.ranks[c], i, c);
   }
+
+  size_type count = this->samples[c].sum(block);
+  size_type seq_pos = this->blockStart(block);
+  return selectInBlock(this->rleBlock(block), seq_pos, count, i, c);
 }
 
 comp_type
@@ -431,36 +1100,113 @@ BWT::operator[](size_type i) const
 {
   if(i >= this->size()) { return 0; }
 
-  size_type block = this->block_rank(i);
-  size_type rle_pos = block * SAMPLE_RATE;
-  size_type seq_pos = (block > 0 ? this->block_select(block) + 1 : 0);
-  while(true)
+  size_type block = this->findBlock(i);
+  if(this->hasFast())
   {
-    range_type run = Run::read(this->data, rle_pos);
-    seq_pos += run.second;  // The start of the next run.
-    if(seq_pos > i) { return run.first; }
+    const FastLayout::Block& record = this->fast[block];
+    return accessInBlock(record.rle, record.start, i);
   }
+
+  size_type seq_pos = this->blockStart(block);
+  return accessInBlock(this->rleBlock(block), seq_pos, i);
 }
 
 range_type
 BWT::inverse_select(size_type i) const
 {
-  range_type run(0, 0);
-  if(i >= this->size()) { return run; }
+  if(i >= this->size()) { return range_type(0, 0); }
 
-  size_type block = this->block_rank(i);
-  size_type rle_pos = block * SAMPLE_RATE;
-  size_type seq_pos = (block > 0 ? this->block_select(block) + 1 : 0);
+  size_type block = this->findBlock(i);
+  if(this->hasFast())
+  {
+    const FastLayout::Block& record = this->fast[block];
+    range_type result = inverseSelectInBlock(record.rle, record.start, i);
+    result.first += record.ranks[result.second];
+    return result;
+  }
 
-  size_type ranks[SIGMA] = {};
-  while(seq_pos <= i)
+  size_type seq_pos = this->blockStart(block);
+  range_type result = inverseSelectInBlock(this->rleBlock(block), seq_pos, i);
+  result.first += this->samples[result.second].sum(block);
+  return result;
+}
+
+void
+BWT::buildFast()
+{
+  size_type blocks = (this->bytes() + SAMPLE_RATE - 1) / SAMPLE_RATE;
+  this->fast.allocate(blocks + 1);
+
+  size_type threads = Parallel::max_threads;
+  ParallelLoop loop(0, blocks, 4 * threads, threads);
+  loop.execute([this](ParallelLoop& chunks)
   {
-    run = Run::read(this->data, rle_pos);
-    seq_pos += run.second;  // The starting position of the next run.
-    ranks[run.first] += run.second; // Number of c's before the next run.
+    for(range_type range = chunks.next(); !(Range::empty(range)); range = chunks.next())
+    {
+      for(size_type block = range.first; block <= range.second; block++)
+      {
+        FastLayout::Block& record = this->fast[block];
+        record.start = this->blockStart(block);
+        for(size_type c = 0; c < SIGMA; c++) { record.ranks[c] = this->samples[c].sum(block); }
+        record.padding = 0;
+        size_type rle_pos = block * SAMPLE_RATE;
+        size_type bytes = std::min(SAMPLE_RATE, this->bytes() - rle_pos);
+        std::memcpy(record.rle, this->data.pointer(rle_pos), bytes);
+        std::memset(record.rle + bytes, 0, SAMPLE_RATE - bytes);
+      }
+    }
+  });
+  loop.join();
+
+  // The sentinel record.
+  FastLayout::Block& sentinel = this->fast[blocks];
+  sentinel.start = this->size();
+  for(size_type c = 0; c < SIGMA; c++) { sentinel.ranks[c] = this->count(c); }
+  sentinel.padding = 0;
+  std::memset(sentinel.rle, 0, SAMPLE_RATE);
+}
+
+void
+BWT::buildDirectory()
+{
+  this->clearDirectory();
+  size_type blocks = (this->bytes() + SAMPLE_RATE - 1) / SAMPLE_RATE;
+
+  // Block starts. Block blocks starts at size().
+  sdsl::int_vector<0> starts(blocks + 1, 0, bit_length(std::max(this->size(), (size_type)1)));
+  for(size_type block = 1; block < blocks; block++) { starts[block] = this->blockStart(block); }
+  starts[blocks] = this->size();
+
+  // Coarse and relative starts.
+  sdsl::int_vector<64> coarse((blocks >> BlockDirectory::GROUP_BITS) + 1, 0);
+  size_type max_relative = 0;
+  for(size_type block = 0; block <= blocks; block++)
+  {
+    size_type group = block >> BlockDirectory::GROUP_BITS;
+    if((block & (BlockDirectory::GROUP_SIZE - 1)) == 0) { coarse[group] = starts[block]; }
+    max_relative = std::max(max_relative, (size_type)(starts[block] - coarse[group]));
+  }
+  sdsl::int_vector<0> relative(blocks + 1, 0, bit_length(std::max(max_relative, (size_type)1)));
+  for(size_type block = 0; block <= blocks; block++)
+  {
+    relative[block] = starts[block] - coarse[block >> BlockDirectory::GROUP_BITS];
   }
 
-  return range_type(this->samples[run.first].sum(block) + ranks[run.first] - (seq_pos - i), run.first);
+  // Samples. Positions after size() map to block blocks.
+  size_type average = std::max(this->size() / std::max(blocks, (size_type)1), (size_type)1);
+  size_type shift = bit_length(average) - 1;
+  sdsl::int_vector<0> samples((this->size() >> shift) + 2, 0, bit_length(std::max(blocks, (size_type)1)));
+  for(size_type j = 0, block = 0; j < samples.size(); j++)
+  {
+    size_type pos = std::min(j << shift, this->size());
+    while(block < blocks && starts[block + 1] <= pos) { block++; }
+    samples[j] = block;
+  }
+
+  this->directory.coarse_starts.swap(coarse);
+  this->directory.relative_starts.swap(relative);
+  this->directory.sampled_blocks.swap(samples);
+  this->directory.shift = shift;
 }
 
 //------------------------------------------------------------------------------
@@ -473,8 +1219,57 @@ BWT::setHeader(const sdsl::int_vector<64>& counts)
   for(size_type c = 0; c < counts.size(); c++) { this->header.bases += counts[c]; }
 }
 
+/*
+  Parallel scanning for build(). The data is processed in rounds of threads * CHUNK_SIZE
+  blocks. In each round, the threads first scan chunks of the data and encode the length
+  of each block and the number of occurrences of each character in it as ByteCode values,
+  with one stream per field. Then each field is added to its sd_vector_builder by a
+  separate thread. The memory overhead is a few bytes per block in the current round.
+*/
+struct BuildStreams
+{
+  typedef std::vector<byte_type> stream_type;
+
+  const static size_type CHUNK_SIZE = 65536;  // Blocks.
+  const static size_type FIELDS     = 1 + BWT::SIGMA;
+
+  std::vector<std::array<stream_type, FIELDS>> chunks;
+  size_type first_block;
+};
+
+void
+scanBlocks(ParallelLoop& loop, const BWT& bwt, BuildStreams& streams)
+{
+  for(range_type range = loop.next(); !(Range::empty(range)); range = loop.next())
+  {
+    for(size_type chunk = range.first; chunk <= range.second; chunk++)
+    {
+      std::array<BuildStreams::stream_type, BuildStreams::FIELDS>& fields = streams.chunks[chunk];
+      for(size_type f = 0; f < BuildStreams::FIELDS; f++) { fields[f].clear(); }
+      size_type rle_pos = (streams.first_block + chunk * BuildStreams::CHUNK_SIZE) * BWT::SAMPLE_RATE;
+      size_type limit = std::min(rle_pos + BuildStreams::CHUNK_SIZE * BWT::SAMPLE_RATE, bwt.bytes());
+
+      size_type block_length = 0;
+      size_type block_counts[BWT::SIGMA] = {};
+      while(rle_pos < limit)
+      {
+        range_type run = Run::read(bwt.data, rle_pos);
+        block_length += run.second; block_counts[run.first] += run.second;
+        if(rle_pos >= bwt.bytes() || rle_pos % BWT::SAMPLE_RATE == 0)
+        {
+          ByteCode::write(fields[0], block_length); block_length = 0;
+          for(size_type c = 0; c < BWT::SIGMA; c++)
+          {
+            ByteCode::write(fields[c + 1], block_counts[c]); block_counts[c] = 0;
+          }
+        }
+      }
+    }
+  }
+}
+
 void
-BWT::build(const sdsl::int_vector<64>& counts)
+BWT::build(const sdsl::int_vector<64>& counts, size_type threads)
 {
   size_type blocks = (this->bytes() + SAMPLE_RATE - 1) / SAMPLE_RATE;
   sdsl::sd_vector_builder block_ends(this->size(), blocks);
@@ -484,31 +1279,92 @@ BWT::build(const sdsl::int_vector<64>& counts)
     block_counts[c] = sdsl::sd_vector_builder(counts[c] + blocks, blocks);
   }
 
-  // Scan the BWT and determine block boundaries and ranks.
-  size_type seq_pos = 0, rle_pos = 0;
-  sdsl::int_vector<64> cumulative(SIGMA, 0);
-  while(rle_pos < this->bytes())
+  if(threads <= 1 || blocks <= BuildStreams::CHUNK_SIZE)
   {
-    range_type run = Run::read(this->data, rle_pos);
-    seq_pos += run.second; cumulative[run.first] += run.second;
-    if(rle_pos >= this->bytes() || rle_pos % SAMPLE_RATE == 0)
+    // Scan the BWT and determine block boundaries and ranks.
+    size_type seq_pos = 0, rle_pos = 0;
+    sdsl::int_vector<64> cumulative(SIGMA, 0);
+    while(rle_pos < this->bytes())
     {
-      block_ends.set(seq_pos - 1);
-      for(size_type c = 0; c < SIGMA; c++)
+      range_type run = Run::read(this->data, rle_pos);
+      seq_pos += run.second; cumulative[run.first] += run.second;
+      if(rle_pos >= this->bytes() || rle_pos % SAMPLE_RATE == 0)
       {
-        block_counts[c].set(cumulative[c]); cumulative[c]++;
+        block_ends.set(seq_pos - 1);
+        for(size_type c = 0; c < SIGMA; c++)
+        {
+          block_counts[c].set(cumulative[c]); cumulative[c]++;
+        }
       }
     }
+
+    // Build rank/select support.
+    this->block_boundaries = sdsl::sd_vector<>(block_ends);
+    sdsl::util::init_support(this->block_rank, &(this->block_boundaries));
+    sdsl::util::init_support(this->block_select, &(this->block_boundaries));
+    for(size_type c = 0; c < SIGMA; c++)
+    {
+      this->samples[c] = CumulativeArray(block_counts[c]);
+    }
+    return;
   }
 
-  // Build rank/select support.
-  this->block_boundaries = sdsl::sd_vector<>(block_ends);
-  sdsl::util::init_support(this->block_rank, &(this->block_boundaries));
-  sdsl::util::init_support(this->block_select, &(this->block_boundaries));
-  for(size_type c = 0; c < SIGMA; c++)
+  // Scan the BWT in rounds and add the fields to the builders in parallel.
+  BuildStreams streams;
+  streams.chunks.resize(threads);
+  size_type values[BuildStreams::FIELDS] = {};
+  for(streams.first_block = 0; streams.first_block < blocks; streams.first_block += threads * BuildStreams::CHUNK_SIZE)
   {
-    this->samples[c] = CumulativeArray(block_counts[c]);
+    size_type chunks = std::min(threads, (blocks - streams.first_block + BuildStreams::CHUNK_SIZE - 1) / BuildStreams::CHUNK_SIZE);
+    {
+      ParallelLoop loop(0, chunks, chunks, threads);
+      loop.execute(scanBlocks, std::cref(*this), std::ref(streams));
+    }
+    {
+      ParallelLoop loop(0, BuildStreams::FIELDS, BuildStreams::FIELDS, threads);
+      loop.execute([&](ParallelLoop& fields)
+      {
+        for(range_type range = fields.next(); !(Range::empty(range)); range = fields.next())
+        {
+          for(size_type f = range.first; f <= range.second; f++)
+          {
+            size_type& value = values[f];
+            for(size_type chunk = 0; chunk < chunks; chunk++)
+            {
+              const BuildStreams::stream_type& stream = streams.chunks[chunk][f];
+              for(size_type i = 0; i < stream.size(); )
+              {
+                value += ByteCode::read(stream, i);
+                if(f == 0) { block_ends.set(value - 1); }
+                else { block_counts[f - 1].set(value); value++; }
+              }
+            }
+          }
+        }
+      });
+    }
   }
+  streams.chunks.clear();
+
+  // Build rank/select support.
+  ParallelLoop loop(0, BuildStreams::FIELDS, BuildStreams::FIELDS, threads);
+  loop.execute([&](ParallelLoop& fields)
+  {
+    for(range_type range = fields.next(); !(Range::empty(range)); range = fields.next())
+    {
+      for(size_type f = range.first; f <= range.second; f++)
+      {
+        if(f == 0)
+        {
+          this->block_boundaries = sdsl::sd_vector<>(block_ends);
+          sdsl::util::init_support(this->block_rank, &(this->block_boundaries));
+          sdsl::util::init_support(this->block_select, &(this->block_boundaries));
+        }
+        else { this->samples[f - 1] = CumulativeArray(block_counts[f - 1]); }
+      }
+    }
+  });
+  loop.join();
 }
 
 void
@@ -518,6 +1374,8 @@ BWT::destroy()
   sdsl::util::clear(this->block_boundaries);
   sdsl::util::clear(this->block_rank);
   sdsl::util::clear(this->block_select);
+  this->clearFast();
+  this->clearDirectory();
 }
 
 //------------------------------------------------------------------------------
@@ -548,6 +1406,19 @@ BWT::hash() const
   return res;
 }
 
+size_type
+BWT::checksum() const
+{
+  size_type res = FNV_OFFSET_BASIS;
+  for(size_type i = 0; i < this->bytes(); i += BlockArray::BLOCK_SIZE)
+  {
+    const byte_type* ptr = this->data.pointer(i);
+    size_type limit = std::min(this->bytes() - i, (size_type)(BlockArray::BLOCK_SIZE));
+    for(size_type j = 0; j < limit; j++) { res = fnv1a_hash(ptr[j], res); }
+  }
+  return res;
+}
+
 //------------------------------------------------------------------------------
 
 } // namespace bwtmerge
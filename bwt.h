@@ -35,6 +35,130 @@ namespace bwtmerge
 
 struct RankArray;
 
+/*
+  An optional query layout for the BWT. Each RLE block is stored in a record after a 64-byte
+  header containing the first sequence position in the block and the number of
+  occurrences of each character before the block. A query that uses the layout reads a
+  single aligned record instead of the samples, the block boundaries, and the BlockArray.
+
+  With the default 64-byte blocks, the layout takes twice the space of the RLE data. There
+  is a sentinel record after the last block, so that position size() also has a block.
+*/
+class FastLayout
+{
+public:
+  typedef bwtmerge::size_type size_type;
+
+  struct Block
+  {
+    size_type      start;
+    size_type      ranks[Run::SIGMA];
+    size_type      padding;
+    Run::code_type rle[Run::BLOCK_SIZE];
+  };
+
+  FastLayout();
+  FastLayout(const FastLayout& source);
+  FastLayout(FastLayout&& source);
+  ~FastLayout();
+
+  void swap(FastLayout& source);
+  FastLayout& operator=(const FastLayout& source);
+  FastLayout& operator=(FastLayout&& source);
+
+  inline size_type size() const { return this->blocks; }
+  inline bool empty() const { return (this->size() == 0); }
+  inline size_type bytes() const { return this->size() * sizeof(Block); }
+
+  // Allocates space for the given number of records. The contents are undefined.
+  void allocate(size_type n);
+  void clear();
+
+  inline const Block& operator[] (size_type i) const { return this->data[i]; }
+  inline Block& operator[] (size_type i) { return this->data[i]; }
+
+  Block*    data;
+  size_type blocks;
+
+private:
+  void copy(const FastLayout& source);
+};  // class FastLayout
+
+//------------------------------------------------------------------------------
+
+/*
+  An optional two-level directory mapping sequence positions to RLE blocks. The start of
+  block b is coarse_starts[b / GROUP_SIZE] + relative_starts[b], where the relative starts
+  use as many bits as the longest group of blocks requires. Position j << shift is sampled
+  for every j, and the sample stores the block containing the position. The shift is chosen
+  so that the sampling interval is not longer than the average block, giving one to two
+  samples per block.
+
+  A query reads two adjacent samples and searches the blocks between them. Usually there
+  are at most two candidates, and their relative starts are in the same cache line. The
+  coarse starts are small enough to stay in cache. The directory takes 4-8 bytes per block,
+  depending on the number of blocks, while the RLE data takes Run::BLOCK_SIZE bytes.
+*/
+struct BlockDirectory
+{
+  typedef bwtmerge::size_type size_type;
+
+  const static size_type GROUP_BITS = 6;
+  const static size_type GROUP_SIZE = (size_type)1 << GROUP_BITS;
+
+  sdsl::int_vector<64> coarse_starts;
+  sdsl::int_vector<0>  relative_starts; // With a sentinel for block size() of the BWT.
+  sdsl::int_vector<0>  sampled_blocks;  // With a sentinel.
+  size_type            shift;
+
+  BlockDirectory() : shift(0) {}
+
+  inline bool empty() const { return this->relative_starts.empty(); }
+  inline size_type bytes() const
+  {
+    return sdsl::size_in_bytes(this->coarse_starts) + sdsl::size_in_bytes(this->relative_starts) +
+           sdsl::size_in_bytes(this->sampled_blocks);
+  }
+
+  inline size_type block(size_type i) const
+  {
+    size_type low = this->sampled_blocks[i >> this->shift];
+    size_type high = this->sampled_blocks[(i >> this->shift) + 1];
+    while(low < high)
+    {
+      size_type mid = low + (high - low + 1) / 2;
+      if(this->start(mid) <= i) { low = mid; }
+      else { high = mid - 1; }
+    }
+    return low;
+  }
+
+  inline size_type start(size_type block) const
+  {
+    return this->coarse_starts[block >> GROUP_BITS] + this->relative_starts[block];
+  }
+
+  // The first two stages of a staged prefetch for block(i). See BWT::prefetch().
+  inline void prefetchSample(size_type i) const
+  {
+    prefetchElement(this->sampled_blocks, i >> this->shift);
+  }
+
+  inline void prefetchStarts(size_type i) const
+  {
+    prefetchElement(this->relative_starts, this->sampled_blocks[i >> this->shift]);
+  }
+
+  inline static void prefetchElement(const sdsl::int_vector<0>& v, size_type i)
+  {
+    __builtin_prefetch(v.data() + ((i * v.width()) >> 6));
+  }
+
+  void clear();
+};
+
+//------------------------------------------------------------------------------
+
 /*
   A basic run-length encoded sequence for alphabet 0-5.
 */
@@ -62,15 +186,23 @@ public:
   BWT& operator=(BWT&& source);
 
   size_type serialize(std::ostream& out, sdsl::structure_tree_node* v = nullptr, std::string name = "") const;
-  void load(std::istream& i);
+  void load(std::istream& in, int fd = -1); // See BlockArray::load().
 
 //------------------------------------------------------------------------------
 
   /*
     This constructor interleaves the source BWTs according to the rank array. All the
-    input structures will be destroyed in the process.
+    input structures will be destroyed in the process. The rank array is merged and the
+    rank/select structures are built using the given number of threads.
   */
-  BWT(BWT& a, BWT&b, RankArray& ra);
+  BWT(BWT& a, BWT&b, RankArray& ra, size_type threads = 1);
+
+  /*
+    This constructor interleaves inputs[0] to inputs[k] in a single pass. Rank array ra[i]
+    gives the positions of inputs[i + 1] in the merged BWT of inputs[0] to inputs[i]. All
+    the input structures will be destroyed in the process.
+  */
+  BWT(std::vector<BWT*>& inputs, std::vector<RankArray>& ra, size_type threads = 1);
 
 //------------------------------------------------------------------------------
 
@@ -129,6 +261,54 @@ public:
   // returns (rank(i, seq[i]), seq[i])
   range_type inverse_select(size_type i) const;
 
+  /*
+    Builds the fast query layout, which is then used by rank(), ranks(i), select(),
+    operator[], and inverse_select(). The layout is not serialized, and it is destroyed
+    along with the rank/select structures when the BWT is merged.
+  */
+  void buildFast();
+  inline void clearFast() { this->fast.clear(); }
+  inline bool hasFast() const { return !(this->fast.empty()); }
+
+  /*
+    Builds the block directory, which then replaces block_rank and block_select in the
+    queries. Like the fast layout, the directory is not serialized.
+  */
+  void buildDirectory();
+  inline void clearDirectory() { this->directory.clear(); }
+  inline bool hasDirectory() const { return !(this->directory.empty()); }
+
+  /*
+    Prefetching a query position is done in three stages, as each stage needs the lines
+    loaded by the previous one. prefetchSample() loads the directory sample, prefetchStarts()
+    the block starts searched from the sample, and prefetch() finds the block and loads its
+    RLE data or fast layout record. A batch of positions should go through each stage
+    before the next one, so that the cache misses within a stage overlap. The first two
+    stages do nothing without the block directory.
+  */
+  inline void prefetchSample(size_type i) const
+  {
+    if(this->hasDirectory()) { this->directory.prefetchSample(std::min(i, this->size())); }
+  }
+
+  inline void prefetchStarts(size_type i) const
+  {
+    if(this->hasDirectory()) { this->directory.prefetchStarts(std::min(i, this->size())); }
+  }
+
+  inline void prefetch(size_type i) const
+  {
+    if(i > this->size()) { i = this->size(); }
+    size_type block = this->findBlock(i);
+    if(this->hasFast())
+    {
+      const FastLayout::Block* record = &(this->fast[block]);
+      __builtin_prefetch(record); __builtin_prefetch(record->rle);
+      return;
+    }
+    this->data.prefetch(block * SAMPLE_RATE);
+  }
+
 //------------------------------------------------------------------------------
 
   template<class ByteVector>
@@ -138,9 +318,9 @@ public:
     buffer.resize(Range::length(range));
 
     // Find the first character.
-    size_type block = this->block_rank(range.first);
+    size_type block = this->findBlock(range.first);
     size_type rle_pos = block * SAMPLE_RATE;
-    size_type seq_pos = (block > 0 ? this->block_select(block) + 1 : 0);
+    size_type seq_pos = this->blockStart(block);
     range_type run(0, 0);
 
     while(true)
@@ -167,6 +347,9 @@ public:
 
   size_type hash() const;
 
+  // FNV-1a hash of the encoded bytes. Faster than hash(), but depends on the encoding.
+  size_type checksum() const;
+
 //------------------------------------------------------------------------------
 
   NativeHeader                     header;
@@ -177,14 +360,39 @@ public:
   sdsl::sd_vector<>::rank_1_type   block_rank;
   sdsl::sd_vector<>::select_1_type block_select;
 
+  FastLayout                       fast;
+  BlockDirectory                   directory;
+
 private:
   void copy(const BWT& source);
   void setVectors();
 
+  /*
+    Runs never cross RLE block boundaries, so a block can be decoded through a raw pointer
+    instead of looking up the BlockArray block for every byte.
+  */
+  inline const Run::code_type* rleBlock(size_type block) const
+  {
+    return this->data.pointer(block * SAMPLE_RATE);
+  }
+
+  // Returns the block containing position i, or the number of blocks if i == size().
+  inline size_type findBlock(size_type i) const
+  {
+    return (this->hasDirectory() ? this->directory.block(i) : this->block_rank(i));
+  }
+
+  // Returns the first sequence position in the block.
+  inline size_type blockStart(size_type block) const
+  {
+    if(this->hasDirectory()) { return this->directory.start(block); }
+    return (block > 0 ? this->block_select(block) + 1 : 0);
+  }
+
   void setHeader(const sdsl::int_vector<64>& counts);
 
-  // Builds/destroys the rank/select structures.
-  void build(const sdsl::int_vector<64>& counts);
+  // Builds/destroys the rank/select structures. The build uses up to the given number of threads.
+  void build(const sdsl::int_vector<64>& counts, size_type threads = Parallel::max_threads);
   void destroy();
 };  // class BWT
 
@@ -0,0 +1,222 @@
+/*
+  Copyright (c) 2015 Genome Research Ltd.
+
+  Author: Jouni Siren <jouni.siren@iki.fi>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include <random>
+
+#include "fmi.h"
+
+using namespace bwtmerge;
+
+//------------------------------------------------------------------------------
+
+/*
+  Benchmarks for the components of BWT-merge. Each mode prints the time taken by the
+  alternative implementations on the same data and checks that the results agree.
+*/
+
+const size_type DEFAULT_SORT_RUNS = 8 * MEGABYTE;
+const size_type SORT_KEY_BITS     = 40;
+
+const size_type DEFAULT_QUERIES = 4 * MEGABYTE;
+const size_type PREFETCH_BATCH  = 16;
+
+void printUsage();
+
+void benchmarkSort(size_type runs);
+void benchmarkPrefetch(const std::string& filename, size_type queries);
+
+//------------------------------------------------------------------------------
+
+int
+main(int argc, char** argv)
+{
+  if(argc < 2)
+  {
+    printUsage();
+    std::exit(EXIT_SUCCESS);
+  }
+
+  std::string mode = argv[1];
+  if(mode == "sort")
+  {
+    size_type runs = (argc > 2 ? std::stoul(argv[2]) : DEFAULT_SORT_RUNS);
+    benchmarkSort(runs);
+  }
+  else if(mode == "prefetch" && argc > 2)
+  {
+    size_type queries = (argc > 3 ? std::stoul(argv[3]) : DEFAULT_QUERIES);
+    benchmarkPrefetch(argv[2], queries);
+  }
+  else
+  {
+    std::cerr << "bwt_benchmark: Invalid mode: " << mode << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+
+void
+printUsage()
+{
+  std::cerr << "Usage: bwt_benchmark mode [arguments]" << std::endl;
+  std::cerr << std::endl;
+
+  std::cerr << "Modes:" << std::endl;
+  std::cerr << "  sort [N]      Sort N random run buffer entries with std::sort and radix sort (default: "
+            << DEFAULT_SORT_RUNS << ")" << std::endl;
+  std::cerr << "  prefetch F [N]  Do N random rank queries in batches on native BWT F without prefetching," << std::endl;
+  std::cerr << "                with single-stage prefetching, and with staged prefetching (default: "
+            << DEFAULT_QUERIES << ")" << std::endl;
+  std::cerr << std::endl;
+}
+
+//------------------------------------------------------------------------------
+
+void
+benchmarkSort(size_type runs)
+{
+  typedef RLArray<BlockArray>::run_type run_type;
+
+  std::cout << "Sorting " << runs << " runs with " << SORT_KEY_BITS << "-bit positions" << std::endl;
+  std::cout << std::endl;
+
+  std::mt19937_64 rng(0xDEADBEEF);
+  std::vector<run_type> original(runs);
+  for(size_type i = 0; i < runs; i++)
+  {
+    original[i] = run_type(rng() & sdsl::bits::lo_set[SORT_KEY_BITS], 1 + rng() % 16);
+  }
+
+  std::vector<run_type> buffer = original;
+  double start = readTimer();
+  sequentialSort(buffer.begin(), buffer.end());
+  double std_seconds = readTimer() - start;
+
+  std::vector<run_type> radix = original;
+  start = readTimer();
+  radixSort(radix.begin(), radix.end());
+  double radix_seconds = readTimer() - start;
+
+  // The radix sort only orders by position.
+  bool ok = true;
+  for(size_type i = 0; i < runs; i++)
+  {
+    if(radix[i].first != buffer[i].first) { ok = false; break; }
+  }
+
+  std::cout << "std::sort:        " << std_seconds << " seconds" << std::endl;
+  std::cout << "Radix sort:       " << radix_seconds << " seconds ("
+            << (std_seconds / radix_seconds) << "x)" << std::endl;
+  std::cout << "Positions:        " << (ok ? "identical" : "DIFFERENT") << std::endl;
+  std::cout << std::endl;
+
+  if(!ok) { std::exit(EXIT_FAILURE); }
+}
+
+//------------------------------------------------------------------------------
+
+/*
+  Runs the queries in batches with 0, 1, or 3 prefetch stages. Single-stage prefetching
+  only issues the last stage, which has to find the block synchronously.
+*/
+size_type
+rankQueries(const BWT& bwt, const std::vector<size_type>& positions, size_type stages)
+{
+  size_type checksum = 0;
+  BWT::ranks_type results;
+  for(size_type start = 0; start < positions.size(); start += PREFETCH_BATCH)
+  {
+    size_type limit = std::min(start + PREFETCH_BATCH, positions.size());
+    if(stages >= 3)
+    {
+      for(size_type j = start; j < limit; j++) { bwt.prefetchSample(positions[j]); }
+      for(size_type j = start; j < limit; j++) { bwt.prefetchStarts(positions[j]); }
+    }
+    if(stages >= 1)
+    {
+      for(size_type j = start; j < limit; j++) { bwt.prefetch(positions[j]); }
+    }
+    for(size_type j = start; j < limit; j++)
+    {
+      bwt.ranks(positions[j], results);
+      for(size_type c = 1; c < BWT::SIGMA; c++) { checksum += results[c]; }
+    }
+  }
+  return checksum;
+}
+
+// The block directory is always built, as the first two stages use it.
+void
+benchmarkPrefetch(const std::string& filename, size_type queries)
+{
+  FMI fmi;
+  load(fmi, filename, NativeFormat::tag, true);
+  std::cout << "Rank queries on " << filename << " (" << fmi.size() << " bases, "
+            << inMegabytes(fmi.bwt.bytes()) << " MB)" << std::endl;
+  std::cout << queries << " random positions in batches of " << PREFETCH_BATCH << std::endl;
+  std::cout << std::endl;
+
+  std::mt19937_64 rng(0xDEADBEEF);
+  std::vector<size_type> positions(queries);
+  for(size_type i = 0; i < queries; i++) { positions[i] = rng() % fmi.size(); }
+
+  bool ok = true;
+  for(size_type layout = 0; layout < 2; layout++)
+  {
+    if(layout == 1) { fmi.bwt.buildFast(); }
+    std::cout << (layout == 0 ? "Directory:" : "Directory and fast layout:") << std::endl;
+
+    const std::string names[3] = { "No prefetch:  ", "Single-stage: ", "Staged:       " };
+    const size_type stages[3] = { 0, 1, 3 };
+    double seconds[3];
+    size_type checksums[3];
+    for(size_type m = 0; m < 3; m++)
+    {
+      double start = readTimer();
+      checksums[m] = rankQueries(fmi.bwt, positions, stages[m]);
+      seconds[m] = readTimer() - start;
+      if(checksums[m] != checksums[0]) { ok = false; }
+      std::cout << "  " << names[m] << seconds[m] << " seconds ("
+                << (queries / seconds[m] / 1000000.0) << " million queries/s)" << std::endl;
+    }
+    double gain = seconds[0] - seconds[2];
+    if(gain > 0)
+    {
+      std::cout << "  Single-stage prefetching captures "
+                << (100.0 * (seconds[0] - seconds[1]) / gain) << "% of the gain" << std::endl;
+    }
+    std::cout << std::endl;
+    fmi.bwt.clearFast();
+  }
+
+  std::cout << "Results:       " << (ok ? "identical" : "DIFFERENT") << std::endl;
+  std::cout << std::endl;
+
+  if(!ok) { std::exit(EXIT_FAILURE); }
+}
+
+//------------------------------------------------------------------------------
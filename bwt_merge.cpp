@@ -40,7 +40,42 @@ void printUsage();
 void verifyFMI(FMI& fmi, const std::string& name,
   const std::vector<std::string>& patterns, std::vector<size_type>& results);
 
+/*
+  Memory-maps the BWT data if requested and the input is in the native format. Builds the
+  block directory if requested.
+*/
+void loadInput(FMI& fmi, const std::string& filename, const std::string& format, bool mapped,
+  bool directory);
+
 void merge(FMI& index, FMI& increment, const MergeParameters& parameters);
+void merge(FMI& index, std::vector<FMI>& inputs, const MergeParameters& parameters);
+
+/*
+  Executes the merge plan, running independent merges concurrently if the memory limit
+  allows it. Concurrent subtrees get the budget minus the peak of the other subtree as their
+  memory limit, and the merges in them compare their own memory usage against it.
+*/
+struct PlanExecutor
+{
+  const MergePlan&                plan;
+  const std::vector<std::string>& filenames;
+  const std::vector<std::string>& formats;
+  const std::vector<std::string>& patterns;
+  std::vector<size_type>&         results;
+  bool                            mapped, directory;
+  std::mutex                      output_lock;
+
+  PlanExecutor(const MergePlan& _plan,
+    const std::vector<std::string>& _filenames, const std::vector<std::string>& _formats,
+    const std::vector<std::string>& _patterns, std::vector<size_type>& _results, bool _mapped,
+    bool _directory) :
+    plan(_plan), filenames(_filenames), formats(_formats), patterns(_patterns), results(_results),
+    mapped(_mapped), directory(_directory)
+  {
+  }
+
+  void execute(size_type node, FMI& result, MergeParameters parameters, size_type budget);
+};
 
 //------------------------------------------------------------------------------
 
@@ -58,11 +93,13 @@ main(int argc, char** argv)
   std::cout << std::endl;
 
   int c = 0;
-  bool verify = false;
+  bool verify = false, single_pass = false, planned = false, mapped = false, fast = false;
+  bool directory = false;
+  size_type kmer_length = 0;
   MergeParameters parameters;
   std::string pattern_name, output_format;
   std::vector<std::string> input_formats;
-  while((c = getopt(argc, argv, "b:m:r:s:t:d:v:i:o:")) != -1)
+  while((c = getopt(argc, argv, "b:m:r:s:t:M:cd:DfkK:pxv:i:o:")) != -1)
   {
     switch(c)
     {
@@ -81,9 +118,33 @@ main(int argc, char** argv)
     case 't':
       parameters.setT(std::stoul(optarg));
       break;
+    case 'c':
+      parameters.checkpoint = true;
+      break;
     case 'd':
       parameters.setTemp(optarg);
       break;
+    case 'D':
+      directory = true;
+      break;
+    case 'f':
+      fast = true;
+      break;
+    case 'M':
+      parameters.setML(std::stoul(optarg));
+      break;
+    case 'k':
+      single_pass = true;
+      break;
+    case 'K':
+      kmer_length = std::stoul(optarg);
+      break;
+    case 'p':
+      planned = true;
+      break;
+    case 'x':
+      mapped = true;
+      break;
     case 'v':
       pattern_name = optarg; verify = true;
       break;
@@ -133,6 +194,11 @@ main(int argc, char** argv)
     std::exit(EXIT_FAILURE);
   }
   if(output_format.length() == 0) { output_format = NativeFormat::tag; }
+  if(single_pass && planned)
+  {
+    std::cerr << "bwt_merge: Options -k and -p cannot be used together" << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
   parameters.sanitize();
   Parallel::max_threads = parameters.threads;
 
@@ -149,6 +215,26 @@ main(int argc, char** argv)
   std::cout << parameters;
   std::cout << std::endl;
 
+  std::vector<std::string> filenames(argv + optind, argv + argc - 1);
+  std::vector<size_type> lengths, bytes;
+  if(planned)
+  {
+    for(int i = 0; i < inputs; i++)
+    {
+      lengths.push_back(bwtLength(filenames[i], input_formats[i]));
+      std::ifstream in(filenames[i].c_str(), std::ios_base::binary);
+      bytes.push_back(in ? fileSize(in) : 0);
+    }
+  }
+  MergePlan plan(lengths, bytes);
+  if(planned)
+  {
+    std::cout << "Merge plan:       " << plan << std::endl;
+    std::cout << "Merged data:      " << inMegabytes(plan.cost()) << " MB (left to right: "
+              << inMegabytes(plan.sequentialCost()) << " MB)" << std::endl;
+    std::cout << std::endl;
+  }
+
   std::vector<std::string> patterns;
   std::vector<size_type> pre_results, post_results;
   if(verify)
@@ -160,20 +246,77 @@ main(int argc, char** argv)
     std::cout << std::endl;
   }
 
-  FMI index; load(index, argv[optind], input_formats[0]);
-  verifyFMI(index, "Input", patterns, pre_results);
-
+  FMI index;
   size_type bytes_added = 0;
-  for(int input = 1; input < inputs; input++)
+  if(single_pass)
+  {
+    // Load the inputs concurrently.
+    std::vector<FMI> sources(inputs);
+    std::vector<std::thread> loaders;
+    for(int input = 0; input < inputs; input++)
+    {
+      loaders.push_back(std::thread([&, input]()
+      {
+        loadInput(sources[input], filenames[input], input_formats[input], mapped, directory);
+      }));
+    }
+    for(int input = 0; input < inputs; input++)
+    {
+      loaders[input].join();
+      if(input > 0) { bytes_added += sources[input].size(); }
+      verifyFMI(sources[input], "Input", patterns, pre_results);
+    }
+    merge(index, sources, parameters);
+  }
+  else if(planned)
   {
-    FMI increment; load(increment, argv[optind + input], input_formats[input]);
-    bytes_added += increment.size();
-    verifyFMI(increment, "Input", patterns, pre_results);
-    merge(index, increment, parameters);
+    for(int input = 1; input < inputs; input++) { bytes_added += lengths[input]; }
+    PlanExecutor executor(plan, filenames, input_formats, patterns, pre_results, mapped, directory);
+    executor.execute(plan.root, index, parameters, parameters.memory_limit);
+  }
+  else
+  {
+    // Load the next increment in the background while merging the current one.
+    FMI next;
+    auto loadNext = [&](int input)
+    {
+      return std::thread([&, input]() { loadInput(next, filenames[input], input_formats[input], mapped, directory); });
+    };
+    std::thread loader = loadNext(1);
+    loadInput(index, filenames[0], input_formats[0], mapped, directory);
+    verifyFMI(index, "Input", patterns, pre_results);
+    for(int input = 1; input < inputs; input++)
+    {
+      loader.join();
+      FMI increment; increment.swap(next);
+      if(input + 1 < inputs) { loader = loadNext(input + 1); }
+      bytes_added += increment.size();
+      verifyFMI(increment, "Input", patterns, pre_results);
+      merge(index, increment, parameters);
+    }
   }
 
-  serialize(index, argv[argc - 1], output_format);
-  verifyFMI(index, "Output", patterns, post_results);
+  // Write the output while verifying it.
+  {
+    std::thread writer([&]() { serialize(index, argv[argc - 1], output_format); });
+    if(verify && fast)
+    {
+      double fast_start = readTimer();
+      index.bwt.buildDirectory(); index.bwt.buildFast();
+      std::cout << "Fast queries:     " << inMegabytes(index.bwt.fast.bytes() + index.bwt.directory.bytes())
+                << " MB built in " << (readTimer() - fast_start) << " seconds" << std::endl;
+    }
+    if(kmer_length > 0)
+    {
+      double kmer_start = readTimer();
+      index.buildKmers(kmer_length);
+      if(output_format == NativeFormat::tag) { serializeKmers(index, argv[argc - 1]); }
+      std::cout << "K-mer table:      " << inMegabytes(index.kmers.bytes()) << " MB for k <= " << kmer_length
+                << " built in " << (readTimer() - kmer_start) << " seconds" << std::endl;
+    }
+    verifyFMI(index, "Output", patterns, post_results);
+    writer.join();
+  }
 
   if(verify)
   {
@@ -221,9 +364,18 @@ printUsage()
             << MergeParameters::defaultSB() << " / thread)" << std::endl;
   std::cerr << "  -t N          Use N parallel threads (default: " << MergeParameters::defaultT()
             << " on this system)" << std::endl;
+  std::cerr << "  -M N          Fit the buffers within N gigabytes of memory (default: "
+            << MergeParameters::defaultML() << ")" << std::endl;
   std::cerr << std::endl;
 
+  std::cerr << "  -c            Keep the rank arrays in the temporary directory for resuming the merge" << std::endl;
   std::cerr << "  -d directory  Use the given directory for temporary files (default: .)" << std::endl;
+  std::cerr << "  -D            Build the block directory for the inputs when loading them" << std::endl;
+  std::cerr << "  -f            Build the fast query structures for verifying the output" << std::endl;
+  std::cerr << "  -k            Merge all inputs in a single pass (all inputs are kept in memory)" << std::endl;
+  std::cerr << "  -K N          Build a table of k-mer ranges for k <= N for the output" << std::endl;
+  std::cerr << "  -p            Plan the merge order by input sizes (the sequence order is kept)" << std::endl;
+  std::cerr << "  -x            Memory-map the BWT data from native format inputs" << std::endl;
   std::cerr << "  -v filename   Verify by querying with patterns from the given file" << std::endl;
   std::cerr << std::endl;
 
@@ -237,28 +389,6 @@ printUsage()
 
 //------------------------------------------------------------------------------
 
-void
-queryFMI(ParallelLoop& loop, const FMI& fmi, const std::vector<std::string>& patterns,
-  std::vector<size_type>& results,
-  std::atomic<size_type>& total_found, std::atomic<size_type>& total_matches)
-{
-  while(true)
-  {
-    range_type range = loop.next();
-    if(Range::empty(range)) { return; }
-
-    size_type found = 0, matches = 0;
-    for(size_type i = range.first; i <= range.second; i++)
-    {
-      range_type result = fmi.find(patterns[i]);
-      results[i] += Range::length(result);
-      if(!(Range::empty(range))) { found++; matches += Range::length(result); }
-    }
-
-    total_found += found; total_matches += matches;
-  }
-}
-
 void
 verifyFMI(FMI& fmi, const std::string& name,
   const std::vector<std::string>& patterns, std::vector<size_type>& results)
@@ -271,11 +401,13 @@ verifyFMI(FMI& fmi, const std::string& name,
   if(chars > 0)
   {
     double start = readTimer();
-    std::atomic<size_type> found(0), matches(0);
+    std::vector<range_type> ranges;
+    fmi.findBatch(patterns, ranges);
+    size_type found = 0, matches = 0;
+    for(size_type i = 0; i < patterns.size(); i++)
     {
-      ParallelLoop loop(0, patterns.size(), Parallel::max_threads, Parallel::max_threads);
-      loop.execute(queryFMI, std::ref(fmi), std::ref(patterns),
-        std::ref(results), std::ref(found), std::ref(matches));
+      results[i] += Range::length(ranges[i]);
+      if(!(Range::empty(ranges[i]))) { found++; matches += Range::length(ranges[i]); }
     }
     double seconds = readTimer() - start;
     printTime(name, found, matches, chars, seconds);
@@ -284,6 +416,14 @@ verifyFMI(FMI& fmi, const std::string& name,
   std::cout << std::endl;
 }
 
+void
+loadInput(FMI& fmi, const std::string& filename, const std::string& format, bool mapped,
+  bool directory)
+{
+  if(mapped && format == NativeFormat::tag) { map(fmi, filename, false, directory); }
+  else { load(fmi, filename, format, directory); }
+}
+
 void
 merge(FMI& index, FMI& increment, const MergeParameters& parameters)
 {
@@ -298,4 +438,80 @@ merge(FMI& index, FMI& increment, const MergeParameters& parameters)
   std::cout << std::endl;
 }
 
+void
+merge(FMI& index, std::vector<FMI>& inputs, const MergeParameters& parameters)
+{
+  size_type bytes_added = 0;
+  for(size_type i = 1; i < inputs.size(); i++) { bytes_added += inputs[i].size(); }
+  double increment_mb = inMegabytes(bytes_added);
+
+  double start = readTimer();
+  FMI temp(inputs, parameters);
+  index.swap(temp);
+  double seconds = readTimer() - start;
+  std::cout << inputs.size() << " BWTs merged in " << seconds << " seconds ("
+            << (increment_mb / seconds) << " MB/s)" << std::endl;
+  std::cout << std::endl;
+}
+
+//------------------------------------------------------------------------------
+
+void
+PlanExecutor::execute(size_type node, FMI& result, MergeParameters parameters, size_type budget)
+{
+  if(this->plan.leaf(node))
+  {
+    loadInput(result, this->filenames[node], this->formats[node], this->mapped, this->directory);
+    std::lock_guard<std::mutex> lock(this->output_lock);
+    verifyFMI(result, "Input", this->patterns, this->results);
+    return;
+  }
+
+  const MergePlan::Node& curr = this->plan.nodes[node];
+  const MergePlan::Node& left_node = this->plan.nodes[curr.left];
+  const MergePlan::Node& right_node = this->plan.nodes[curr.right];
+  FMI left, right;
+  if(parameters.memory_limit > 0 && left_node.peak + right_node.peak <= budget)
+  {
+    MergeParameters left_parameters = parameters, right_parameters = parameters;
+    left_parameters.setT(std::max(parameters.threads / 2, (size_type)1));
+    right_parameters.setT(std::max(parameters.threads - parameters.threads / 2, (size_type)1));
+    left_parameters.memory_limit = budget - right_node.peak;
+    right_parameters.memory_limit = budget - left_node.peak;
+    left_parameters.merge_budget = right_parameters.merge_budget = true;
+    std::thread worker(&PlanExecutor::execute, this, curr.left, std::ref(left),
+      left_parameters, left_parameters.memory_limit);
+    this->execute(curr.right, right, right_parameters, right_parameters.memory_limit);
+    worker.join();
+  }
+  else
+  {
+    this->execute(curr.left, left, parameters, budget);
+    budget = (budget > left_node.bytes ? budget - left_node.bytes : 0);
+    MergeParameters right_parameters = parameters;
+    if(parameters.merge_budget)
+    {
+      // The resident size would include the left result, but the estimated usage does not.
+      right_parameters.memory_limit = std::max(budget, (size_type)1);
+    }
+    this->execute(curr.right, right, right_parameters, budget);
+  }
+
+  // Use the larger BWT as the base.
+  double start = readTimer();
+  {
+    FMI temp;
+    if(right.size() > left.size()) { FMI merged(right, left, parameters, true); temp.swap(merged); }
+    else { FMI merged(left, right, parameters, false); temp.swap(merged); }
+    result.swap(temp);
+  }
+  double seconds = readTimer() - start;
+
+  std::lock_guard<std::mutex> lock(this->output_lock);
+  std::cout << "Inputs " << (curr.inputs.first + 1) << "-" << (curr.inputs.second + 1)
+            << " merged in " << seconds << " seconds ("
+            << (inMegabytes(std::min(left_node.length, right_node.length)) / seconds) << " MB/s)" << std::endl;
+  std::cout << std::endl;
+}
+
 //------------------------------------------------------------------------------
@@ -22,7 +22,10 @@
   SOFTWARE.
 */
 
-#include <stack>
+#include <condition_variable>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "fmi.h"
 
@@ -54,6 +57,7 @@ FMI::copy(const FMI& source)
 {
   this->bwt = source.bwt;
   this->alpha = source.alpha;
+  this->kmers = source.kmers;
 }
 
 void
@@ -63,6 +67,7 @@ FMI::swap(FMI& source)
   {
     this->bwt.swap(source.bwt);
     this->alpha.swap(source.alpha);
+    this->kmers.swap(source.kmers);
   }
 }
 
@@ -80,6 +85,7 @@ FMI::operator=(FMI&& source)
   {
     this->bwt = std::move(source.bwt);
     this->alpha = std::move(source.alpha);
+    this->kmers = std::move(source.kmers);
   }
   return *this;
 }
@@ -98,9 +104,9 @@ FMI::serialize(std::ostream& out, sdsl::structure_tree_node* v, std::string name
 }
 
 void
-FMI::load(std::istream& in)
+FMI::load(std::istream& in, int fd)
 {
-  this->bwt.load(in);
+  this->bwt.load(in, fd);
   this->alpha.load(in);
 }
 
@@ -136,45 +142,469 @@ FMI::load<NativeFormat>(const std::string& filename)
 
 //------------------------------------------------------------------------------
 
+/*
+  Returns the length of the longest common suffix of the patterns as comp values.
+*/
+size_type
+sharedSuffix(const std::string& a, const std::string& b, const Alphabet& alpha)
+{
+  size_type res = 0;
+  while(res < a.length() && res < b.length() &&
+    alpha.char2comp[a[a.length() - 1 - res]] == alpha.char2comp[b[b.length() - 1 - res]]) { res++; }
+  return res;
+}
+
+/*
+  Runs backward search for patterns order[range.first] to order[range.second]. ranges[d]
+  is the range for the suffix of length d of the previous pattern, and keys[d] is its key
+  in the k-mer table or NO_KEY.
+*/
+void
+searchSorted(const FMI& fmi, const std::vector<std::string>& patterns, const std::vector<size_type>& order,
+  range_type range, std::vector<range_type>& results)
+{
+  const size_type NO_KEY = ~(size_type)0;
+  std::vector<range_type> ranges(1, range_type(0, fmi.size() - 1));
+  std::vector<size_type> keys(1, 0);
+
+  const std::string* prev = 0;
+  for(size_type i = range.first; i <= range.second; i++)
+  {
+    const std::string& pattern = patterns[order[i]];
+    size_type depth = (prev != 0 ? sharedSuffix(*prev, pattern, fmi.alpha) : 0);
+    ranges.resize(depth + 1); keys.resize(depth + 1);
+
+    for(size_type d = depth; d < pattern.length(); d++)
+    {
+      comp_type comp = fmi.alpha.char2comp[pattern[pattern.length() - 1 - d]];
+      range_type curr = ranges[d];
+      size_type key = NO_KEY;
+      if(d < fmi.kmers.k && keys[d] != NO_KEY && comp > 0 && comp <= fmi.kmers.base)
+      {
+        key = (comp - 1) + fmi.kmers.base * keys[d];
+        curr = fmi.kmers.range(d + 1, key);
+      }
+      else if(d == 0) { curr = fmi.charRange(comp); }
+      else if(!(Range::empty(curr))) { curr = fmi.LF(curr, comp); }
+      ranges.push_back(curr); keys.push_back(key);
+    }
+
+    results[order[i]] = ranges[pattern.length()];
+    prev = &pattern;
+  }
+}
+
+void
+FMI::findBatch(const std::vector<std::string>& patterns, std::vector<range_type>& results) const
+{
+  results.resize(patterns.size());
+  if(patterns.empty()) { return; }
+
+  // Sort the patterns by their reverse comp sequences.
+  std::vector<size_type> order(patterns.size());
+  for(size_type i = 0; i < order.size(); i++) { order[i] = i; }
+  std::sort(order.begin(), order.end(), [&](size_type a, size_type b)
+  {
+    const std::string& x = patterns[a]; const std::string& y = patterns[b];
+    size_type shared = sharedSuffix(x, y, this->alpha);
+    if(shared >= y.length()) { return false; }
+    if(shared >= x.length()) { return true; }
+    return (this->alpha.char2comp[x[x.length() - 1 - shared]] < this->alpha.char2comp[y[y.length() - 1 - shared]]);
+  });
+
+  size_type threads = Parallel::max_threads;
+  ParallelLoop loop(0, order.size(), BATCHES_PER_THREAD * threads, threads);
+  loop.execute([&](ParallelLoop& batches)
+  {
+    for(range_type range = batches.next(); !(Range::empty(range)); range = batches.next())
+    {
+      searchSorted(*this, patterns, order, range, results);
+    }
+  });
+}
+
+//------------------------------------------------------------------------------
+
+const std::string KmerTable::EXTENSION = ".kmers";
+
+KmerTable::KmerTable() :
+  k(0), base(0), bwt_size(0), bwt_sequences(0), bwt_checksum(0)
+{
+}
+
+void
+KmerTable::swap(KmerTable& source)
+{
+  if(this != &source)
+  {
+    std::swap(this->k, source.k);
+    std::swap(this->base, source.base);
+    std::swap(this->bwt_size, source.bwt_size);
+    std::swap(this->bwt_sequences, source.bwt_sequences);
+    std::swap(this->bwt_checksum, source.bwt_checksum);
+    this->bwt_counts.swap(source.bwt_counts);
+    this->ranges.swap(source.ranges);
+    this->offsets.swap(source.offsets);
+  }
+}
+
+KmerTable::size_type
+KmerTable::serialize(std::ostream& out, sdsl::structure_tree_node* v, std::string name) const
+{
+  sdsl::structure_tree_node* child = sdsl::structure_tree::add_child(v, name, sdsl::util::class_name(*this));
+  size_type written_bytes = 0;
+
+  uint32_t tag = TAG;
+  written_bytes += sdsl::write_member(tag, out, child, "tag");
+  written_bytes += sdsl::write_member(this->k, out, child, "k");
+  written_bytes += sdsl::write_member(this->base, out, child, "base");
+  written_bytes += sdsl::write_member(this->bwt_size, out, child, "bwt_size");
+  written_bytes += sdsl::write_member(this->bwt_sequences, out, child, "bwt_sequences");
+  written_bytes += sdsl::write_member(this->bwt_checksum, out, child, "bwt_checksum");
+  written_bytes += this->bwt_counts.serialize(out, child, "bwt_counts");
+  written_bytes += this->ranges.serialize(out, child, "ranges");
+
+  sdsl::structure_tree::add_size(child, written_bytes);
+  return written_bytes;
+}
+
+void
+KmerTable::load(std::istream& in)
+{
+  uint32_t tag = 0;
+  sdsl::read_member(tag, in);
+  if(tag != TAG)
+  {
+    std::cerr << "KmerTable::load(): Invalid tag!" << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  sdsl::read_member(this->k, in);
+  sdsl::read_member(this->base, in);
+  sdsl::read_member(this->bwt_size, in);
+  sdsl::read_member(this->bwt_sequences, in);
+  sdsl::read_member(this->bwt_checksum, in);
+  this->bwt_counts.load(in);
+  this->ranges.load(in);
+  this->setOffsets();
+}
+
+void
+KmerTable::setFingerprint(const FMI& fmi)
+{
+  this->bwt_size = fmi.size();
+  this->bwt_sequences = fmi.sequences();
+  this->bwt_checksum = fmi.bwt.checksum();
+  this->bwt_counts = fmi.alpha.C;
+}
+
+bool
+KmerTable::matches(const FMI& fmi) const
+{
+  // Compare the checksum last, as it requires a scan of the BWT data.
+  if(this->bwt_size != fmi.size() || this->bwt_sequences != fmi.sequences()) { return false; }
+  if(this->base + 1 != fmi.alpha.sigma || this->bwt_counts.size() != fmi.alpha.C.size()) { return false; }
+  for(size_type c = 0; c < this->bwt_counts.size(); c++)
+  {
+    if(this->bwt_counts[c] != fmi.alpha.C[c]) { return false; }
+  }
+  return (this->bwt_checksum == fmi.bwt.checksum());
+}
+
+void
+KmerTable::setOffsets()
+{
+  this->offsets = std::vector<size_type>(this->k + 2, 0);
+  size_type level_size = 1;
+  for(size_type length = 1; length <= this->k; length++)
+  {
+    level_size *= this->base;
+    this->offsets[length + 1] = this->offsets[length] + level_size;
+  }
+}
+
+void
+KmerTable::build(const FMI& fmi, size_type max_k)
+{
+  this->clear();
+  if(max_k == 0 || fmi.alpha.sigma <= 1) { return; }
+
+  size_type base = fmi.alpha.sigma - 1, entries = 0, level_size = 1;
+  for(size_type length = 1; length <= max_k; length++)
+  {
+    level_size *= base; entries += level_size;
+    if(entries > MAX_ENTRIES)
+    {
+      std::cerr << "KmerTable::build(): The table for k = " << max_k << " would have over "
+                << MAX_ENTRIES << " entries" << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+  }
+
+  this->k = max_k; this->base = base;
+  this->setFingerprint(fmi);
+  this->setOffsets();
+  this->ranges = sdsl::int_vector<64>(2 * entries, 0);
+
+  for(size_type c = 1; c <= this->base; c++)
+  {
+    range_type range = fmi.charRange(c);
+    this->ranges[2 * (c - 1)] = range.first; this->ranges[2 * (c - 1) + 1] = range.second;
+  }
+
+  // Extend the patterns of each length backward by one character.
+  for(size_type length = 2; length <= this->k; length++)
+  {
+    size_type level_size = this->offsets[length] - this->offsets[length - 1];
+    ParallelLoop loop(0, level_size, Parallel::max_threads * 16, Parallel::max_threads);
+    loop.execute([&](ParallelLoop& keys)
+    {
+      for(range_type range = keys.next(); !(Range::empty(range)); range = keys.next())
+      {
+        for(size_type key = range.first; key <= range.second; key++)
+        {
+          range_type suffix = this->range(length - 1, key);
+          for(size_type c = 1; c <= this->base; c++)
+          {
+            range_type result = (Range::empty(suffix) ? Range::empty_range() : fmi.LF(suffix, c));
+            size_type i = 2 * (this->offsets[length] + (c - 1) + this->base * key);
+            this->ranges[i] = result.first; this->ranges[i + 1] = result.second;
+          }
+        }
+      }
+    });
+  }
+}
+
+void
+KmerTable::clear()
+{
+  this->k = 0; this->base = 0;
+  this->bwt_size = 0; this->bwt_sequences = 0; this->bwt_checksum = 0;
+  sdsl::util::clear(this->bwt_counts);
+  sdsl::util::clear(this->ranges);
+  this->offsets.clear();
+}
+
+//------------------------------------------------------------------------------
+
+/*
+  Worker threads hand over their full thread buffers to a queue of pending buffers. A
+  background thread merges the pending buffers into the merge buffers and writes the
+  result to disk when all merge buffers are full. The merge buffers are only accessed by
+  the background thread, while the workers only hold the queue lock for a swap.
+
+  The buffers are written to disk by another background thread. The merging thread can
+  continue while one buffer is being written and another is waiting to be written.
+
+  If the memory limit is the budget of a single merge, memory usage is estimated from the
+  inputs, the buffers of the workers, and the bytes in the queues and the merge buffers.
+  Otherwise it is the resident size of the process.
+*/
 struct MergeBuffer
 {
   typedef RLArray<BlockArray> buffer_type;
   typedef RLArray<BlockArray>::run_type run_type;
 
+  const static size_type PENDING_BUFFERS = MergeParameters::MERGE_PENDING;  // Workers wait when the queue is full.
+  const static size_type SPILL_MARGIN = 10;  // Spill when within 1/SPILL_MARGIN of the memory limit.
+  const static size_type PENDING_SPILLS = 1;  // The merging thread waits when the queue is full.
+
   MergeParameters parameters;
 
-  std::mutex               buffer_lock;
   std::vector<buffer_type> merge_buffers;
 
+  std::mutex               queue_lock;
+  std::condition_variable  queue_changed;
+  std::vector<buffer_type> pending;
+  bool                     finished;
+  std::thread              merger;
+
+  std::mutex               spill_lock;
+  std::condition_variable  spill_changed;
+  std::vector<buffer_type> spills;
+  std::vector<std::string> spill_files;
+  bool                     spills_finished;
+  std::thread              spiller;
+
   std::mutex ra_lock;
   RankArray  ra;
   size_type  ra_values, ra_bytes;
 
   size_type  size;
 
-  MergeBuffer(size_type _size, const MergeParameters& _parameters) :
+  size_type              base;      // Inputs and worker buffers.
+  std::atomic<size_type> buffered;  // Bytes in the queues and the merge buffers.
+
+  MergeBuffer(size_type _size, const MergeParameters& _parameters, size_type input_bytes) :
     parameters(_parameters),
     merge_buffers(_parameters.merge_buffers),
-    ra_values(0), ra_bytes(0), size(_size)
+    finished(false), spills_finished(false),
+    ra_values(0), ra_bytes(0), size(_size),
+    base(input_bytes + _parameters.threads *
+      (_parameters.thread_buffer_size + _parameters.run_buffer_size * sizeof(run_type))),
+    buffered(0)
+  {
+    this->merger = std::thread(&MergeBuffer::mergePending, this);
+    this->spiller = std::thread(&MergeBuffer::writePending, this);
+  }
+
+  ~MergeBuffer() { this->stop(); this->stopSpills(); }
+
+  size_type usage() const
   {
+    return (this->parameters.merge_budget ? this->base + this->buffered : residentMemory());
   }
 
-  ~MergeBuffer() {}
+  /*
+    Merges the buffers into the first one and adjusts the buffered bytes.
+  */
+  void merge(buffer_type& buffer, buffer_type& temp_buffer)
+  {
+    size_type before = buffer.bytes() + temp_buffer.bytes();
+    buffer = buffer_type(buffer, temp_buffer);
+    this->buffered += buffer.bytes(); this->buffered -= before;
+  }
 
+  /*
+    Moves the contents of the buffer to the queue, waiting if the queue is full.
+  */
+  void insert(buffer_type& buffer)
+  {
+    std::unique_lock<std::mutex> lock(this->queue_lock);
+    while(this->pending.size() >= PENDING_BUFFERS) { this->queue_changed.wait(lock); }
+    this->buffered += buffer.bytes();
+    this->pending.push_back(buffer_type());
+    this->pending.back().swap(buffer);
+    this->queue_changed.notify_all();
+  }
+
+  /*
+    The background thread. Runs until the queue is empty and stop() has been called.
+  */
+  void mergePending()
+  {
+    buffer_type buffer, temp_buffer;
+    while(true)
+    {
+      {
+        std::unique_lock<std::mutex> lock(this->queue_lock);
+        while(this->pending.empty() && !(this->finished)) { this->queue_changed.wait(lock); }
+        if(this->pending.empty()) { return; }
+        buffer.swap(this->pending.back()); this->pending.pop_back();
+        this->queue_changed.notify_all();
+      }
+
+      // Spill the merge buffers early if we are close to the memory limit.
+      size_type limit = this->parameters.memory_limit;
+      if(limit > 0 && this->usage() + limit / SPILL_MARGIN >= limit)
+      {
+        for(size_type i = 0; i < this->merge_buffers.size(); i++)
+        {
+          if(this->merge_buffers[i].empty()) { continue; }
+          temp_buffer.swap(this->merge_buffers[i]);
+          this->merge(buffer, temp_buffer);
+        }
+#ifdef VERBOSE_STATUS_INFO
+        {
+          std::lock_guard<std::mutex> lock(Parallel::stderr_access);
+          std::cerr << "buildRA(): Close to the memory limit; spilling "
+                    << buffer.values() << " values to disk" << std::endl;
+        }
+#endif
+        this->write(buffer); continue;
+      }
+
+      bool done = false;
+      for(size_type i = 0; i < this->merge_buffers.size(); i++)
+      {
+        if(this->merge_buffers[i].empty())
+        {
+          buffer.swap(this->merge_buffers[i]); done = true;
+#ifdef VERBOSE_STATUS_INFO
+          std::lock_guard<std::mutex> lock(Parallel::stderr_access);
+          std::cerr << "buildRA(): Added the values to buffer " << i << std::endl;
+#endif
+          break;
+        }
+        temp_buffer.swap(this->merge_buffers[i]);
+        this->merge(buffer, temp_buffer);
+      }
+      if(!done) { this->write(buffer); }
+    }
+  }
+
+  void stop()
+  {
+    {
+      std::lock_guard<std::mutex> lock(this->queue_lock);
+      this->finished = true;
+      this->queue_changed.notify_all();
+    }
+    if(this->merger.joinable()) { this->merger.join(); }
+  }
+
+  /*
+    Adds the buffer to the rank array and moves its contents to the spill queue, waiting if
+    the queue is full.
+  */
   void write(buffer_type& buffer)
   {
     if(buffer.empty()) { return; }
 
     std::string filename;
-    size_type buffer_values = buffer.values(), buffer_bytes = buffer.bytes();
     {
       std::lock_guard<std::mutex> lock(this->ra_lock);
       filename = tempFile(this->parameters.tempPrefix());
       this->ra.filenames.push_back(filename);
       this->ra.run_counts.push_back(buffer.size());
       this->ra.value_counts.push_back(buffer.values());
+      this->ra.samples.push_back(std::vector<RankArray::sample_type>());
+      this->ra.samples.back().swap(buffer.samples);
     }
+
+    std::unique_lock<std::mutex> lock(this->spill_lock);
+    while(this->spills.size() >= PENDING_SPILLS) { this->spill_changed.wait(lock); }
+    this->spills.push_back(buffer_type()); this->spills.back().swap(buffer);
+    this->spill_files.push_back(filename);
+    this->spill_changed.notify_all();
+  }
+
+  /*
+    The spill thread. Runs until the queue is empty and stopSpills() has been called.
+  */
+  void writePending()
+  {
+    buffer_type buffer;
+    std::string filename;
+    while(true)
+    {
+      {
+        std::unique_lock<std::mutex> lock(this->spill_lock);
+        while(this->spills.empty() && !(this->spills_finished)) { this->spill_changed.wait(lock); }
+        if(this->spills.empty()) { return; }
+        buffer.swap(this->spills.front()); this->spills.erase(this->spills.begin());
+        filename = this->spill_files.front(); this->spill_files.erase(this->spill_files.begin());
+        this->spill_changed.notify_all();
+      }
+      this->spill(buffer, filename);
+    }
+  }
+
+  void stopSpills()
+  {
+    {
+      std::lock_guard<std::mutex> lock(this->spill_lock);
+      this->spills_finished = true;
+      this->spill_changed.notify_all();
+    }
+    if(this->spiller.joinable()) { this->spiller.join(); }
+  }
+
+  void spill(buffer_type& buffer, const std::string& filename)
+  {
+    size_type buffer_values = buffer.values(), buffer_bytes = buffer.bytes();
     buffer.write(filename); buffer.clear();
+    this->buffered -= buffer_bytes;
 
 #ifdef VERBOSE_STATUS_INFO
     double ra_done, ra_gb;
@@ -192,18 +622,21 @@ struct MergeBuffer
 #ifdef VERBOSE_STATUS_INFO
     {
       std::lock_guard<std::mutex> lock(Parallel::stderr_access);
-      std::cerr << "buildRA(): Thread " << std::this_thread::get_id()
-                << ": Added the values to the rank array" << std::endl;
+      std::cerr << "buildRA(): Added the values to the rank array" << std::endl;
       std::cerr << "buildRA(): " << ra_done << "% done; RA size " << ra_gb << " GB" << std::endl;
     }
 #endif
   }
 
+  /*
+    Waits for the background threads to finish and writes the merge buffers to disk.
+  */
   void flush()
   {
+    this->stop();
     for(size_type i = 1; i < this->merge_buffers.size(); i++)
     {
-      this->merge_buffers[i] = buffer_type(this->merge_buffers[i], this->merge_buffers[i - 1]);
+      this->merge(this->merge_buffers[i], this->merge_buffers[i - 1]);
     }
 #ifdef VERBOSE_STATUS_INFO
     {
@@ -214,6 +647,7 @@ struct MergeBuffer
     }
 #endif
     this->write(this->merge_buffers[this->merge_buffers.size() - 1]);
+    this->stopSpills();
   }
 };
 
@@ -223,6 +657,7 @@ mergeRA(MergeBuffer& mb, MergeBuffer::buffer_type& thread_buffer,
 {
   MergeBuffer::buffer_type temp_buffer(run_buffer); run_buffer.clear();
   thread_buffer = MergeBuffer::buffer_type(thread_buffer, temp_buffer);
+  if(thread_buffer.empty()) { return; }
   if(!force && thread_buffer.bytes() < mb.parameters.thread_buffer_size) { return; }
 
 #ifdef VERBOSE_STATUS_INFO
@@ -233,107 +668,321 @@ mergeRA(MergeBuffer& mb, MergeBuffer::buffer_type& thread_buffer,
   }
 #endif
 
-  for(size_type i = 0; i < mb.merge_buffers.size(); i++)
+  mb.insert(thread_buffer);
+}
+
+//------------------------------------------------------------------------------
+
+/*
+  A stack of merge positions. Each position consists of a range in b and a position in each
+  of the k inputs merged so far. The position in the merged BWT is the sum of the latter.
+*/
+struct MergeStack
+{
+  // The positions are processed in batches, and the cache lines needed for each batch are
+  // prefetched in stages before processing it. See BWT::prefetch().
+  const static size_type BATCH_SIZE = 16;
+
+  size_type               k;
+  std::vector<range_type> b_ranges;
+  std::vector<size_type>  a_positions;  // k positions for each range.
+
+  explicit MergeStack(size_type _k) : k(_k) {}
+
+  inline size_type size() const { return this->b_ranges.size(); }
+  inline bool empty() const { return this->b_ranges.empty(); }
+
+  void swap(MergeStack& source)
   {
-    bool done = false;
-    {
-      std::lock_guard<std::mutex> lock(mb.buffer_lock);
-      if(mb.merge_buffers[i].empty()) { thread_buffer.swap(mb.merge_buffers[i]); done = true; }
-      else { temp_buffer.swap(mb.merge_buffers[i]); }
-    }
-    if(done)
-    {
-#ifdef VERBOSE_STATUS_INFO
-      std::lock_guard<std::mutex> lock(Parallel::stderr_access);
-      std::cerr << "buildRA(): Thread " << std::this_thread::get_id()
-                << ": Added the values to buffer " << i << std::endl;
-#endif
-      return;
-    }
-    thread_buffer = MergeBuffer::buffer_type(thread_buffer, temp_buffer);
+    std::swap(this->k, source.k);
+    this->b_ranges.swap(source.b_ranges);
+    this->a_positions.swap(source.a_positions);
   }
 
-  mb.write(thread_buffer);
-}
+  inline void push(const std::vector<size_type>& a_pos, range_type b_range)
+  {
+    this->b_ranges.push_back(b_range);
+    this->a_positions.insert(this->a_positions.end(), a_pos.begin(), a_pos.end());
+  }
 
-//------------------------------------------------------------------------------
+  inline range_type pop(std::vector<size_type>& a_pos)
+  {
+    range_type b_range = this->b_ranges.back(); this->b_ranges.pop_back();
+    size_type offset = this->a_positions.size() - this->k;
+    for(size_type i = 0; i < this->k; i++) { a_pos[i] = this->a_positions[offset + i]; }
+    this->a_positions.resize(offset);
+    return b_range;
+  }
+
+  /*
+    Moves the bottom half of the stack to the other stack. The positions at the bottom are
+    closest to the root of the traversal, so they usually have the largest subtrees.
+  */
+  void split(MergeStack& other)
+  {
+    size_type n = this->size() / 2;
+    other.k = this->k;
+    other.b_ranges.assign(this->b_ranges.begin(), this->b_ranges.begin() + n);
+    other.a_positions.assign(this->a_positions.begin(), this->a_positions.begin() + n * this->k);
+    this->b_ranges.erase(this->b_ranges.begin(), this->b_ranges.begin() + n);
+    this->a_positions.erase(this->a_positions.begin(), this->a_positions.begin() + n * this->k);
+  }
+};
 
-struct MergePosition
+/*
+  Work sharing for buildRA(). When a thread runs out of sequence blocks, it waits for the
+  busy threads to hand over the bottom halves of their stacks. The traversal finishes when
+  all threads are waiting and there is no work left.
+*/
+struct MergeWork
 {
-  size_type  a_pos;
-  range_type b_range;
+  std::mutex              mtx;
+  std::condition_variable available;
+  std::vector<MergeStack> pool;
+  size_type               threads, idle;
+  bool                    finished;
+
+  std::atomic<size_type>  waiting;  // Idle threads not matched by stacks in the pool.
+
+  explicit MergeWork(size_type _threads) :
+    threads(_threads), idle(0), finished(false), waiting(0)
+  {
+  }
+
+  /*
+    Called by a thread without work. Returns false when the traversal has finished.
+  */
+  bool get(MergeStack& stack)
+  {
+    std::unique_lock<std::mutex> lock(this->mtx);
+    this->idle++; this->waiting = this->idle - this->pool.size();
+    while(this->pool.empty() && !(this->finished))
+    {
+      if(this->idle >= this->threads) { this->finished = true; this->available.notify_all(); }
+      else { this->available.wait(lock); }
+    }
+    if(this->pool.empty()) { return false; }
 
-  MergePosition() : a_pos(0), b_range(0, 0) {}
-  MergePosition(size_type a, size_type b) : a_pos(a), b_range(b, b) {}
-  MergePosition(size_type pos, range_type range) : a_pos(pos), b_range(range) {}
-  MergePosition(size_type pos, size_type sp, size_type ep) : a_pos(pos), b_range(sp, ep) {}
+    stack.swap(this->pool.back()); this->pool.pop_back();
+    this->idle--; this->waiting = this->idle - this->pool.size();
+    return true;
+  }
+
+  /*
+    Hands over the bottom half of the stack to a waiting thread.
+  */
+  void donate(MergeStack& stack)
+  {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    if(this->pool.size() >= this->idle) { return; }
+    this->pool.push_back(MergeStack(stack.k));
+    stack.split(this->pool.back());
+    this->waiting = this->idle - this->pool.size();
+    this->available.notify_one();
+  }
 };
 
+/*
+  Builds the rank array of b relative to the merged BWT of the inputs in a. The sequences
+  of b are inserted after the first start[i] sequences of each input.
+*/
 void
-buildRA(ParallelLoop& loop, const FMI& a, const FMI& b, MergeBuffer& mb)
+buildRA(ParallelLoop& loop, MergeWork& work, const std::vector<const FMI*>& a,
+  const std::vector<size_type>& start, const FMI& b, MergeBuffer& mb)
 {
+  size_type k = a.size();
+  MergeBuffer::buffer_type thread_buffer;
+  std::vector<MergeBuffer::run_type> run_buffer; run_buffer.reserve(mb.parameters.run_buffer_size);
+  MergeStack positions(k);
+  std::vector<range_type> batch_b(MergeStack::BATCH_SIZE);
+  std::vector<std::vector<size_type>> batch_a(MergeStack::BATCH_SIZE, std::vector<size_type>(k));
+  std::vector<size_type> next_a(k);
+  std::vector<BWT::ranks_type> a_pos(k);
+  BWT::ranks_type b_sp, b_ep;
+  BWT::rank_ranges_type b_range;
+
+  size_type batch_size = 0;
+  auto prefetchBatch = [&](void (FMI::*stage)(size_type) const)
+  {
+    for(size_type j = 0; j < batch_size; j++)
+    {
+      (b.*stage)(batch_b[j].first);
+      if(Range::length(batch_b[j]) > FMI::SHORT_RANGE) { (b.*stage)(batch_b[j].second + 1); }
+      for(size_type i = 0; i < k; i++) { (a[i]->*stage)(batch_a[j][i]); }
+    }
+  };
+
   while(true)
   {
-    range_type sequence_range = loop.next();
-    if(Range::empty(sequence_range)) { return; }
+    if(positions.empty())
+    {
+      range_type sequence_range = loop.next();
+      if(!(Range::empty(sequence_range))) { positions.push(start, sequence_range); }
+      else
+      {
+        if(!(run_buffer.empty()) || !(thread_buffer.empty()))
+        {
+          mergeRA(mb, thread_buffer, run_buffer, true);
+        }
+        if(!(work.get(positions))) { break; }
+      }
+    }
 
-    MergeBuffer::buffer_type thread_buffer;
-    std::vector<MergeBuffer::run_type> run_buffer; run_buffer.reserve(mb.parameters.run_buffer_size);
-    std::stack<MergePosition> positions;
-    BWT::ranks_type a_pos, b_sp, b_ep;
-    BWT::rank_ranges_type b_range;
+    batch_size = std::min(positions.size(), MergeStack::BATCH_SIZE);
+    for(size_type j = 0; j < batch_size; j++) { batch_b[j] = positions.pop(batch_a[j]); }
+    prefetchBatch(&FMI::prefetchSample);
+    prefetchBatch(&FMI::prefetchStarts);
+    prefetchBatch(&FMI::prefetch);
 
-    positions.push(MergePosition(a.sequences(), sequence_range));
-    while(!(positions.empty()))
+    for(size_type j = 0; j < batch_size; j++)
     {
-      MergePosition curr = positions.top(); positions.pop();
-      run_buffer.push_back(MergeBuffer::run_type(curr.a_pos, Range::length(curr.b_range)));
+      range_type curr = batch_b[j];
+      const std::vector<size_type>& curr_a = batch_a[j];
+      size_type merged_pos = 0;
+      for(size_type i = 0; i < k; i++) { merged_pos += curr_a[i]; }
+      run_buffer.push_back(MergeBuffer::run_type(merged_pos, Range::length(curr)));
       if(run_buffer.size() >= mb.parameters.run_buffer_size)
       {
         mergeRA(mb, thread_buffer, run_buffer, false);
       }
 
-      if(Range::length(curr.b_range) == 1)
+      if(Range::length(curr) == 1)
       {
-        range_type pred = b.LF(curr.b_range.first);
+        range_type pred = b.LF(curr.first);
         if(pred.second != 0)
         {
-          positions.push(MergePosition(a.LF(curr.a_pos, pred.second), pred.first));
+          for(size_type i = 0; i < k; i++) { next_a[i] = a[i]->LF(curr_a[i], pred.second); }
+          positions.push(next_a, range_type(pred.first, pred.first));
         }
       }
-      else if(Range::length(curr.b_range) <= FMI::SHORT_RANGE)
+      else if(Range::length(curr) <= FMI::SHORT_RANGE)
       {
-        b.LF(curr.b_range, b_range);
+        b.LF(curr, b_range);
         for(size_type c = 1; c < b.alpha.sigma; c++)
         {
           if(!(Range::empty(b_range[c])))
           {
-            positions.push(MergePosition(a.LF(curr.a_pos, c), b_range[c]));
+            for(size_type i = 0; i < k; i++) { next_a[i] = a[i]->LF(curr_a[i], c); }
+            positions.push(next_a, b_range[c]);
           }
         }
       }
       else
       {
-        a.LF(curr.a_pos, a_pos); b.LF(curr.b_range, b_sp, b_ep);
+        for(size_type i = 0; i < k; i++) { a[i]->LF(curr_a[i], a_pos[i]); }
+        b.LF(curr, b_sp, b_ep);
         for(size_type c = 1; c < b.alpha.sigma; c++)
         {
-          if(b_sp[c] <= b_ep[c]) { positions.push(MergePosition(a_pos[c], b_sp[c], b_ep[c])); }
+          if(b_sp[c] <= b_ep[c])
+          {
+            for(size_type i = 0; i < k; i++) { next_a[i] = a_pos[i][c]; }
+            positions.push(next_a, range_type(b_sp[c], b_ep[c]));
+          }
         }
       }
     }
 
-    mergeRA(mb, thread_buffer, run_buffer, true);
-  #ifdef VERBOSE_STATUS_INFO
-    {
-      std::lock_guard<std::mutex> lock(Parallel::stderr_access);
-      std::cerr << "buildRA(): Thread " << std::this_thread::get_id() << ": Finished block "
-                << sequence_range << std::endl;
-    }
-  #endif
+    if(work.waiting > 0 && positions.size() > 1) { work.donate(positions); }
   }
+
+#ifdef VERBOSE_STATUS_INFO
+  {
+    std::lock_guard<std::mutex> lock(Parallel::stderr_access);
+    std::cerr << "buildRA(): Thread " << std::this_thread::get_id() << ": Finished" << std::endl;
+  }
+#endif
 }
 
-FMI::FMI(FMI& a, FMI& b, MergeParameters parameters)
+void
+buildRankArray(const std::vector<const FMI*>& a, const std::vector<size_type>& start,
+  const FMI& b, MergeBuffer& mb)
+{
+#ifdef VERBOSE_STATUS_INFO
+  double timer = readTimer();
+#endif
+
+  {
+    ParallelLoop loop(0, b.sequences(), mb.parameters.sequence_blocks, mb.parameters.threads);
+    MergeWork work(loop.threads.size());
+    loop.execute(buildRA, std::ref(work), std::ref(a), std::ref(start), std::ref(b), std::ref(mb));
+  }
+  mb.flush();
+
+#ifdef VERBOSE_STATUS_INFO
+  double seconds = readTimer() - timer;
+  std::cerr << "bwt_merge: RA built in " << seconds << " seconds" << std::endl;
+  std::cerr << "bwt_merge: Memory usage with RA: " << inGigabytes(memoryUsage()) << " GB" << std::endl;
+#endif
+}
+
+/*
+  The name of the rank array manifest is based on the sizes of the inputs, so that a
+  restarted merge finds the manifest of the same merge.
+*/
+std::string
+checkpointName(const MergeParameters& parameters, const std::vector<const FMI*>& a,
+  const std::vector<size_type>& start, const FMI& b)
+{
+  std::stringstream ss;
+  ss << parameters.tempPrefix() << "_checkpoint";
+  for(size_type i = 0; i < a.size(); i++)
+  {
+    ss << '_' << a[i]->size() << '_' << a[i]->sequences() << '_' << start[i];
+  }
+  ss << '_' << b.size() << '_' << b.sequences();
+  return ss.str();
+}
+
+/*
+  The identity of the inputs stored in the manifest. Inputs with the same sizes but with
+  different contents or in a different order have different identities.
+*/
+std::string
+checkpointIdentity(const std::vector<const FMI*>& a, const std::vector<size_type>& start,
+  const FMI& b)
+{
+  std::stringstream ss;
+  for(size_type i = 0; i < a.size(); i++)
+  {
+    ss << a[i]->size() << ' ' << a[i]->sequences() << ' ' << start[i] << ' '
+       << a[i]->bwt.bytes() << ' ' << a[i]->bwt.checksum() << ' ';
+  }
+  ss << b.size() << ' ' << b.sequences() << ' ' << b.bwt.bytes() << ' ' << b.bwt.checksum();
+  return ss.str();
+}
+
+/*
+  Builds the rank array, or reads it from the manifest if checkpoints are enabled and the
+  manifest exists. Returns the name of the manifest or an empty string.
+*/
+std::string
+checkpointRankArray(const std::vector<const FMI*>& a, const std::vector<size_type>& start,
+  const FMI& b, MergeBuffer& mb)
+{
+  if(!(mb.parameters.checkpoint))
+  {
+    buildRankArray(a, start, b, mb);
+    return std::string();
+  }
+
+  std::string manifest = checkpointName(mb.parameters, a, start, b);
+  std::string identity = checkpointIdentity(a, start, b);
+  if(mb.ra.readManifest(manifest, identity))
+  {
+    std::cerr << "bwt_merge: Resuming with the rank array from " << manifest << std::endl;
+    return manifest;
+  }
+  buildRankArray(a, start, b, mb);
+  mb.ra.writeManifest(manifest, identity);
+  return manifest;
+}
+
+FMI::FMI(FMI& a, FMI& b, MergeParameters parameters) :
+  FMI(a, b, parameters, false)
+{
+}
+
+FMI::FMI(FMI& a, FMI& b, MergeParameters parameters, bool b_first)
 {
   if(a.alpha != b.alpha)
   {
@@ -345,27 +994,155 @@ FMI::FMI(FMI& a, FMI& b, MergeParameters parameters)
   std::cerr << "bwt_merge: " << a.sequences() << " sequences of total length " << a.size() << std::endl;
   std::cerr << "bwt_merge: Adding " << b.sequences() << " sequences of total length " << b.size() << std::endl;
   std::cerr << "bwt_merge: Memory usage before merging: " << inGigabytes(memoryUsage()) << " GB" << std::endl;
-  double start = readTimer();
 #endif
 
-  std::vector<range_type> bounds = getBounds(range_type(0, b.sequences() - 1), parameters.sequence_blocks);
+  size_type input_bytes = a.bwt.bytes() + b.bwt.bytes();
+  parameters.fitMemory(parameters.merge_budget ? input_bytes : residentMemory());
+  MergeBuffer mb(b.size(), parameters, input_bytes);
+  std::vector<const FMI*> base(1, &a);
+  std::vector<size_type> start(1, (b_first ? 0 : a.sequences()));
+  std::string manifest = checkpointRankArray(base, start, b, mb);
+
+  this->bwt = BWT(a.bwt, b.bwt, mb.ra, parameters.threads);
+  if(!(manifest.empty())) { remove(manifest.c_str()); }
+  this->alpha = a.alpha;
+  for(size_type c = 0; c <= this->alpha.sigma; c++) { this->alpha.C[c] += b.alpha.C[c]; }
+}
 
-  MergeBuffer mb(b.size(), parameters);
+FMI::FMI(std::vector<FMI>& inputs, MergeParameters parameters)
+{
+  if(inputs.empty()) { return; }
+  for(size_type i = 1; i < inputs.size(); i++)
   {
-    ParallelLoop loop(0, b.sequences(), parameters.sequence_blocks, parameters.threads);
-    loop.execute(buildRA, std::ref(a), std::ref(b), std::ref(mb));
+    if(inputs[i].alpha != inputs[0].alpha)
+    {
+      std::cerr << "FMI::FMI(): Cannot merge BWTs with different alphabets" << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
   }
-  mb.flush();
 
+  // Build the rank array for each input relative to the earlier inputs.
+  std::vector<const FMI*> base;
+  std::vector<size_type> start;
+  std::vector<RankArray> ra(inputs.size() - 1);
+  std::vector<std::string> manifests;
+  size_type input_bytes = 0;
+  for(size_type i = 1; i < inputs.size(); i++)
+  {
+    base.push_back(&(inputs[i - 1])); start.push_back(inputs[i - 1].sequences());
 #ifdef VERBOSE_STATUS_INFO
-  double seconds = readTimer() - start;
-  std::cerr << "bwt_merge: RA built in " << seconds << " seconds" << std::endl;
-  std::cerr << "bwt_merge: Memory usage with RA: " << inGigabytes(memoryUsage()) << " GB" << std::endl;
+    std::cerr << "bwt_merge: Adding " << inputs[i].sequences() << " sequences of total length "
+              << inputs[i].size() << " to " << base.size() << " inputs" << std::endl;
+    std::cerr << "bwt_merge: Memory usage before merging: " << inGigabytes(memoryUsage()) << " GB" << std::endl;
 #endif
+    input_bytes += inputs[i - 1].bwt.bytes();
+    parameters.fitMemory(parameters.merge_budget ? input_bytes + inputs[i].bwt.bytes() : residentMemory());
+    MergeBuffer mb(inputs[i].size(), parameters, input_bytes + inputs[i].bwt.bytes());
+    manifests.push_back(checkpointRankArray(base, start, inputs[i], mb));
+    ra[i - 1].swap(mb.ra);
+  }
 
-  this->bwt = BWT(a.bwt, b.bwt, mb.ra);
-  this->alpha = a.alpha;
-  for(size_type c = 0; c <= this->alpha.sigma; c++) { this->alpha.C[c] += b.alpha.C[c]; }
+  std::vector<BWT*> bwts;
+  for(size_type i = 0; i < inputs.size(); i++) { bwts.push_back(&(inputs[i].bwt)); }
+  this->bwt = BWT(bwts, ra, parameters.threads);
+  for(size_type i = 0; i < manifests.size(); i++)
+  {
+    if(!(manifests[i].empty())) { remove(manifests[i].c_str()); }
+  }
+  this->alpha = inputs[0].alpha;
+  for(size_type i = 1; i < inputs.size(); i++)
+  {
+    for(size_type c = 0; c <= this->alpha.sigma; c++) { this->alpha.C[c] += inputs[i].alpha.C[c]; }
+  }
+}
+
+//------------------------------------------------------------------------------
+
+MergePlan::MergePlan(const std::vector<size_type>& lengths, const std::vector<size_type>& bytes) :
+  input_count(lengths.size()), root(NO_CHILD)
+{
+  if(this->inputs() == 0) { return; }
+
+  for(size_type i = 0; i < this->inputs(); i++)
+  {
+    Node leaf = { range_type(i, i), NO_CHILD, NO_CHILD, lengths[i], bytes[i], bytes[i] };
+    this->nodes.push_back(leaf);
+  }
+
+  // costs[i * n + j] is the minimal total length of the merges for inputs i to j, and
+  // splits[i * n + j] is the last input of the left subtree in the optimal plan.
+  size_type n = this->inputs();
+  std::vector<size_type> costs(n * n, 0), splits(n * n, 0), sums(n + 1, 0);
+  for(size_type i = 0; i < n; i++) { sums[i + 1] = sums[i] + lengths[i]; }
+  for(size_type len = 2; len <= n; len++)
+  {
+    for(size_type i = 0, j = len - 1; j < n; i++, j++)
+    {
+      size_type best = ~(size_type)0;
+      for(size_type k = i; k < j; k++)
+      {
+        size_type cost = costs[i * n + k] + costs[(k + 1) * n + j];
+        if(cost < best) { best = cost; splits[i * n + j] = k; }
+      }
+      costs[i * n + j] = best + sums[j + 1] - sums[i];
+    }
+  }
+
+  this->root = this->build(range_type(0, n - 1), splits);
+}
+
+size_type
+MergePlan::build(range_type range, const std::vector<size_type>& splits)
+{
+  if(range.first == range.second) { return range.first; }
+
+  size_type split = splits[range.first * this->inputs() + range.second];
+  size_type left = this->build(range_type(range.first, split), splits);
+  size_type right = this->build(range_type(split + 1, range.second), splits);
+
+  const Node& l = this->nodes[left]; const Node& r = this->nodes[right];
+  Node node = { range, left, right, l.length + r.length, l.bytes + r.bytes, 0 };
+  node.peak = std::max(std::max(l.peak, l.bytes + r.peak), 2 * node.bytes);
+  this->nodes.push_back(node);
+  return this->nodes.size() - 1;
+}
+
+size_type
+MergePlan::cost() const
+{
+  size_type result = 0;
+  for(size_type i = this->inputs(); i < this->nodes.size(); i++) { result += this->nodes[i].length; }
+  return result;
+}
+
+size_type
+MergePlan::sequentialCost() const
+{
+  size_type result = 0, prefix = 0;
+  for(size_type i = 0; i < this->inputs(); i++)
+  {
+    prefix += this->nodes[i].length;
+    if(i > 0) { result += prefix; }
+  }
+  return result;
+}
+
+void
+printPlan(std::ostream& stream, const MergePlan& plan, size_type node)
+{
+  if(plan.leaf(node)) { stream << (node + 1); return; }
+  stream << "(";
+  printPlan(stream, plan, plan.nodes[node].left);
+  stream << " ";
+  printPlan(stream, plan, plan.nodes[node].right);
+  stream << ")";
+}
+
+std::ostream&
+operator<< (std::ostream& stream, const MergePlan& plan)
+{
+  if(plan.root != MergePlan::NO_CHILD) { printPlan(stream, plan, plan.root); }
+  return stream;
 }
 
 //------------------------------------------------------------------------------
@@ -409,11 +1186,12 @@ serialize(const FMI& fmi, const std::string& filename, const std::string& format
 }
 
 void
-load(FMI& fmi, const std::string& filename, const std::string& format)
+load(FMI& fmi, const std::string& filename, const std::string& format, bool directory)
 {
   if(format == NativeFormat::tag)
   {
     fmi.load<NativeFormat>(filename);
+    loadKmers(fmi, filename);
   }
   else if(format == PlainFormatD::tag)
   {
@@ -444,6 +1222,56 @@ load(FMI& fmi, const std::string& filename, const std::string& format)
     std::cerr << "load(): Invalid BWT format: " << format << std::endl;
     std::exit(EXIT_FAILURE);
   }
+  if(directory) { fmi.bwt.buildDirectory(); }
+}
+
+void
+map(FMI& fmi, const std::string& filename, bool prefault, bool directory)
+{
+  std::ifstream in(filename.c_str(), std::ios_base::binary);
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if(!in || fd < 0)
+  {
+    std::cerr << "map(): Cannot open input file " << filename << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  fmi.load(in, fd);
+  ::close(fd); in.close();  // The mapping remains valid.
+  if(prefault) { fmi.bwt.data.willNeed(); }
+  loadKmers(fmi, filename);
+  if(directory) { fmi.bwt.buildDirectory(); }
+}
+
+bool
+loadKmers(FMI& fmi, const std::string& filename)
+{
+  std::string table_name = filename + KmerTable::EXTENSION;
+  std::ifstream in(table_name.c_str(), std::ios_base::binary);
+  if(!in) { return false; }
+
+  KmerTable table; table.load(in);
+  in.close();
+  if(!(table.matches(fmi)))
+  {
+    std::cerr << "loadKmers(): The table in " << table_name << " is for a different BWT" << std::endl;
+    return false;
+  }
+  fmi.kmers.swap(table);
+  return true;
+}
+
+void
+serializeKmers(const FMI& fmi, const std::string& filename)
+{
+  std::string table_name = filename + KmerTable::EXTENSION;
+  std::ofstream out(table_name.c_str(), std::ios_base::binary);
+  if(!out)
+  {
+    std::cerr << "serializeKmers(): Cannot open output file " << table_name << std::endl;
+    return;
+  }
+  fmi.kmers.serialize(out);
+  out.close();
 }
 
 //------------------------------------------------------------------------------
@@ -455,7 +1283,8 @@ MergeParameters::MergeParameters() :
   run_buffer_size(RUN_BUFFER_SIZE), thread_buffer_size(THREAD_BUFFER_SIZE),
   merge_buffers(MERGE_BUFFERS),
   threads(Parallel::max_threads), sequence_blocks(threads * BLOCKS_PER_THREAD),
-  temp_dir(DEFAULT_TEMP_DIR)
+  memory_limit(MEMORY_LIMIT * GIGABYTE),
+  temp_dir(DEFAULT_TEMP_DIR), checkpoint(false), merge_budget(false)
 {
 }
 
@@ -467,6 +1296,36 @@ MergeParameters::sanitize()
   this->threads = std::min(this->threads, this->sequence_blocks);
 }
 
+void
+MergeParameters::fitMemory(size_type resident)
+{
+  if(this->memory_limit == 0) { return; }
+
+  // Leave at least a tenth of the limit for the buffers, even if we are already over it.
+  size_type available = std::max(this->memory_limit - std::min(resident, this->memory_limit),
+    this->memory_limit / 10);
+  size_type threads = std::max(this->threads, (size_type)1);
+
+  size_type run_buffer = std::max(available / (4 * threads * sizeof(run_type)), MEGABYTE / sizeof(run_type));
+  this->run_buffer_size = std::min(this->run_buffer_size, run_buffer);
+
+  size_type thread_buffer = std::max(available / (4 * (threads + MERGE_PENDING)), MEGABYTE);
+  this->thread_buffer_size = std::min(this->thread_buffer_size, thread_buffer);
+
+  // Merge buffer i may contain up to 2^i thread buffers.
+  size_type levels = 1;
+  while(levels < this->merge_buffers &&
+    ((((size_type)1 << (levels + 1)) - 1) * this->thread_buffer_size <= available / 2)) { levels++; }
+  this->merge_buffers = std::min(this->merge_buffers, levels);
+
+#ifdef VERBOSE_STATUS_INFO
+  std::cerr << "bwt_merge: Fitting the buffers into " << inGigabytes(available) << " GB: run buffers "
+            << inMegabytes(this->run_buffer_size * sizeof(run_type)) << " MB, thread buffers "
+            << inMegabytes(this->thread_buffer_size) << " MB, "
+            << this->merge_buffers << " merge buffers" << std::endl;
+#endif
+}
+
 void
 MergeParameters::setTemp(const std::string& directory)
 {
@@ -490,7 +1349,16 @@ operator<< (std::ostream& stream, const MergeParameters& parameters)
   stream << "Merge buffers:    " << parameters.merge_buffers << std::endl;
   stream << "Threads:          " << parameters.threads << std::endl;
   stream << "Sequence blocks:  " << parameters.sequence_blocks << std::endl;
+  if(parameters.memory_limit > 0)
+  {
+    stream << "Memory limit:     " << inGigabytes(parameters.memory_limit) << " GB"
+           << (parameters.merge_budget ? " (this merge)" : "") << std::endl;
+  }
   stream << "Temp directory:   " << parameters.temp_dir << std::endl;
+  if(parameters.checkpoint)
+  {
+    stream << "Checkpoints:      " << parameters.temp_dir << std::endl;
+  }
   return stream;
 }
 
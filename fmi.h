@@ -38,7 +38,109 @@ namespace bwtmerge
 class FMI;
 
 void serialize(const FMI& fmi, const std::string& filename, const std::string& format);
-void load(FMI& fmi, const std::string& filename, const std::string& format);
+
+// If directory is set, the block directory is built for the loaded BWT.
+void load(FMI& fmi, const std::string& filename, const std::string& format, bool directory = false);
+
+/*
+  Loads a native format file, memory-mapping the BWT data instead of reading it. Only the
+  pages that are accessed are read, and the kernel can drop them under memory pressure.
+  Processes mapping the same file share the pages in the page cache. If prefault is set,
+  the kernel starts reading the entire BWT data in the background. If directory is set,
+  the block directory is built after mapping.
+*/
+void map(FMI& fmi, const std::string& filename, bool prefault = false, bool directory = false);
+
+/*
+  Reads the k-mer table for the FMI from filename + KmerTable::EXTENSION. Returns false if
+  the file does not exist or if the table was built for a different BWT. Loading or mapping
+  a native format file also loads the table if it exists.
+*/
+bool loadKmers(FMI& fmi, const std::string& filename);
+void serializeKmers(const FMI& fmi, const std::string& filename);
+
+//------------------------------------------------------------------------------
+
+/*
+  A table of BWT ranges for all patterns of length 1 to k over comp values 1 to sigma - 1.
+  The key of a pattern is its sequence of comp values minus one, read as a number in base
+  sigma - 1 with the first character as the least significant digit. Hence prepending
+  character c to a pattern with key x gives key (c - 1) + (sigma - 1) * x.
+
+  The table for k-mers up to k has about sigma^k entries of 16 bytes, so it is only
+  practical for small alphabets and k up to 10-12.
+*/
+class KmerTable
+{
+public:
+  typedef bwtmerge::size_type size_type;
+
+  const static uint32_t    TAG = 0x4B4D4552;
+  const static size_type   MAX_ENTRIES = (size_type)1 << 32;
+  const static std::string EXTENSION;  // .kmers
+
+  KmerTable();
+
+  void swap(KmerTable& source);
+
+  size_type serialize(std::ostream& out, sdsl::structure_tree_node* v = nullptr, std::string name = "") const;
+  void load(std::istream& in);
+
+  // Builds the table for k-mers up to the given length using the current number of threads.
+  void build(const FMI& fmi, size_type max_k);
+  void clear();
+
+  /*
+    The table stores a fingerprint of the BWT it was built for: the size, the number of
+    sequences, the character counts, and the checksum of the BWT data.
+  */
+  void setFingerprint(const FMI& fmi);
+  bool matches(const FMI& fmi) const;
+
+  inline bool empty() const { return (this->k == 0); }
+  inline size_type bytes() const { return sdsl::size_in_bytes(this->ranges); }
+
+  inline range_type range(size_type length, size_type key) const
+  {
+    size_type i = 2 * (this->offsets[length] + key);
+    return range_type(this->ranges[i], this->ranges[i + 1]);
+  }
+
+  /*
+    Finds the range for the longest suffix of the pattern of length at most k consisting of
+    comp values 1 to sigma - 1. Returns false if there is no such suffix. Otherwise sets end
+    to point to the first character of the suffix.
+  */
+  template<class Iterator>
+  bool find(Iterator begin, Iterator& end, const Alphabet& alpha, range_type& result) const
+  {
+    size_type key = 0, length = 0;
+    Iterator curr = end;
+    while(length < this->k && curr != begin)
+    {
+      Iterator prev = curr; --prev;
+      comp_type comp = alpha.char2comp[*prev];
+      if(comp == 0 || comp > this->base) { break; }
+      key = (comp - 1) + this->base * key; length++;
+      curr = prev;
+    }
+    if(length == 0) { return false; }
+
+    result = this->range(length, key);
+    end = curr;
+    return true;
+  }
+
+  size_type k, base;
+  size_type bwt_size, bwt_sequences, bwt_checksum;
+  sdsl::int_vector<64> bwt_counts; // Alphabet::C of the BWT.
+  sdsl::int_vector<64> ranges;     // Pairs of range endpoints.
+
+private:
+  std::vector<size_type> offsets; // The first entry for patterns of each length.
+
+  void setOffsets();
+};  // class KmerTable
 
 //------------------------------------------------------------------------------
 
@@ -50,6 +152,8 @@ struct MergeParameters
   const static size_type THREAD_BUFFER_SIZE = 256 * MEGABYTE; // Bytes.
   const static size_type MERGE_BUFFERS = 6;
   const static size_type BLOCKS_PER_THREAD = 4;
+  const static size_type MEMORY_LIMIT = 0;                    // Gigabytes; 0 means no limit.
+  const static size_type MERGE_PENDING = 4;                   // Thread buffers waiting to be merged.
 
   const static std::string DEFAULT_TEMP_DIR;  // .
   const static std::string TEMP_FILE_PREFIX;  // .bwtmerge
@@ -63,12 +167,22 @@ struct MergeParameters
   inline static size_type defaultMB() { return MERGE_BUFFERS; }
   inline static size_type defaultT()  { return Parallel::max_threads; }
   inline static size_type defaultSB() { return BLOCKS_PER_THREAD; }
+  inline static size_type defaultML() { return MEMORY_LIMIT; }
 
   inline void setRB(size_type mb) { this->run_buffer_size = mb * MEGABYTE / sizeof(run_type); }
   inline void setTB(size_type mb) { this->thread_buffer_size = mb * MEGABYTE; }
   inline void setMB(size_type n)  { this->merge_buffers = n; }
   inline void setT(size_type n)   { this->threads = n; }
   inline void setSB(size_type n)  { this->sequence_blocks = n; }
+  inline void setML(size_type gb) { this->memory_limit = gb * GIGABYTE; }
+
+  /*
+    Shrinks the buffers to fit within the memory limit, given the current memory usage.
+    Run buffers and thread buffers may use a quarter of the remaining memory each, and
+    merge buffers the other half. With merge_budget, the usage is the size of the inputs
+    of the merge instead of the resident size of the process.
+  */
+  void fitMemory(size_type resident);
 
   void setTemp(const std::string& directory);
   std::string tempPrefix() const;
@@ -76,7 +190,10 @@ struct MergeParameters
   size_type run_buffer_size, thread_buffer_size;
   size_type merge_buffers;
   size_type threads, sequence_blocks;
+  size_type memory_limit;
   std::string temp_dir;
+  bool checkpoint;  // Keep a manifest of the rank array in the temp directory.
+  bool merge_budget;  // memory_limit is the budget of this merge among concurrent merges.
 };
 
 std::ostream& operator<< (std::ostream& stream, const MergeParameters& parameters);
@@ -89,6 +206,7 @@ public:
   typedef BWT::size_type size_type;
 
   const static size_type SHORT_RANGE = 256; // Compute LF(range) by a linear scan of the BWT.
+  const static size_type BATCHES_PER_THREAD = 4;  // For findBatch().
 
   FMI();
   FMI(const FMI& source);
@@ -100,7 +218,7 @@ public:
   FMI& operator=(FMI&& source);
 
   size_type serialize(std::ostream& out, sdsl::structure_tree_node* v = nullptr, std::string name = "") const;
-  void load(std::istream& i);
+  void load(std::istream& in, int fd = -1); // See BlockArray::load().
 
 //------------------------------------------------------------------------------
 
@@ -109,6 +227,18 @@ public:
   */
   FMI(FMI& a, FMI& b, MergeParameters parameters = MergeParameters());
 
+  /*
+    As above, but the sequences of b are inserted before the sequences of a if b_first is set.
+    This allows using the larger BWT as the base without changing the order of the sequences.
+  */
+  FMI(FMI& a, FMI& b, MergeParameters parameters, bool b_first);
+
+  /*
+    This constructor merges the inputs in a single pass, destroying them in the process.
+    The sequences from each input are inserted after the sequences from the earlier inputs.
+  */
+  explicit FMI(std::vector<FMI>& inputs, MergeParameters parameters = MergeParameters());
+
 //------------------------------------------------------------------------------
 
   template<class Format>
@@ -159,6 +289,11 @@ public:
     return bwtmerge::LF(this->bwt, this->alpha, range, comp);
   }
 
+  // See BWT::prefetch().
+  inline void prefetchSample(size_type i) const { this->bwt.prefetchSample(i); }
+  inline void prefetchStarts(size_type i) const { this->bwt.prefetchStarts(i); }
+  inline void prefetch(size_type i) const { this->bwt.prefetch(i); }
+
   /*
     Computes LF(i) for comp values 1 to sigma - 1.
   */
@@ -192,13 +327,23 @@ public:
     }
   }
 
+  /*
+    Builds the k-mer table for patterns up to length k. If the table exists, backward
+    search starts from the range of the longest suffix of the pattern in the table.
+  */
+  inline void buildKmers(size_type k) { this->kmers.build(*this, k); }
+
   template<class Iterator>
   range_type find(Iterator begin, Iterator end) const
   {
     if(begin == end) { return range_type(0, this->size() - 1); }
 
-    --end;
-    range_type range = this->charRange(this->alpha.char2comp[*end]);
+    range_type range;
+    if(!(this->kmers.find(begin, end, this->alpha, range)))
+    {
+      --end;
+      range = this->charRange(this->alpha.char2comp[*end]);
+    }
     while(!Range::empty(range) && end != begin)
     {
       --end;
@@ -220,10 +365,19 @@ public:
     return this->find(pattern, pattern + length);
   }
 
+  /*
+    Finds the ranges for a batch of patterns, storing find(patterns[i]) in results[i]. The
+    patterns are sorted by their reverse comp sequences, and backward search follows the
+    resulting trie, so that the steps for a shared suffix are done only once. The sorted
+    patterns are split into contiguous batches for parallel threads.
+  */
+  void findBatch(const std::vector<std::string>& patterns, std::vector<range_type>& results) const;
+
 //------------------------------------------------------------------------------
 
-  BWT      bwt;
-  Alphabet alpha;
+  BWT       bwt;
+  Alphabet  alpha;
+  KmerTable kmers;
 
 private:
   void copy(const FMI& source);
@@ -231,6 +385,51 @@ private:
 
 //------------------------------------------------------------------------------
 
+/*
+  A plan for merging a sequence of inputs. Each internal node merges two consecutive ranges
+  of inputs, so the sequences remain in input order. The plan minimizes the total length of
+  the merged BWTs, which is the amount of data interleaved during the merges.
+
+  The nodes for the inputs come first, followed by the internal nodes in post-order. Memory
+  estimates are based on the given input sizes in bytes: merging requires memory for both
+  inputs and the result, and the result of the left subtree is kept in memory while the right
+  subtree is being merged.
+*/
+struct MergePlan
+{
+  struct Node
+  {
+    range_type inputs;      // Closed range of inputs.
+    size_type  left, right; // Children of an internal node.
+    size_type  length;      // Total length of the inputs.
+    size_type  bytes;       // Estimated size of the merged BWT.
+    size_type  peak;        // Estimated peak memory usage when merging the subtree.
+  };
+
+  const static size_type NO_CHILD = ~(size_type)0;
+
+  MergePlan(const std::vector<size_type>& lengths, const std::vector<size_type>& bytes);
+
+  inline size_type inputs() const { return this->input_count; }
+  inline bool leaf(size_type node) const { return (this->nodes[node].left == NO_CHILD); }
+
+  // Total length of the merged BWTs.
+  size_type cost() const;
+
+  // Total length of the merged BWTs when merging the inputs from left to right.
+  size_type sequentialCost() const;
+
+  std::vector<Node> nodes;
+  size_type         input_count, root;
+
+private:
+  size_type build(range_type range, const std::vector<size_type>& splits);
+};
+
+std::ostream& operator<< (std::ostream& stream, const MergePlan& plan);
+
+//------------------------------------------------------------------------------
+
 template<>
 void
 FMI::serialize<NativeFormat>(const std::string& filename) const;
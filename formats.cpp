@@ -24,6 +24,10 @@
 
 #include <cstring>
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 #include "formats.h"
 
 namespace bwtmerge
@@ -123,6 +127,200 @@ const std::string SGAFormat::tag = "sga";
 
 //------------------------------------------------------------------------------
 
+/*
+  Calls emit(c, length) for each maximal run of character c in data[0, n), except the last
+  one. Returns the starting position of the last run. The run boundaries are found by
+  comparing each block of 32 (AVX2) or 16 (SSE2) bytes with the block starting one byte
+  later, so long runs are skipped a block at a time.
+*/
+template<class Emit>
+size_type
+findRuns(const char_type* data, size_type n, Emit emit)
+{
+  size_type i = 0, run_start = 0;
+  auto boundaries = [&](size_type base, uint64_t mask)
+  {
+    while(mask != 0)
+    {
+      size_type end = base + __builtin_ctzll(mask) + 1;
+      emit(data[run_start], end - run_start); run_start = end;
+      mask &= mask - 1;
+    }
+  };
+
+#if defined(__AVX2__)
+  for(; i + 33 <= n; i += 32)
+  {
+    __m256i curr = _mm256_loadu_si256((const __m256i*)(data + i));
+    __m256i next = _mm256_loadu_si256((const __m256i*)(data + i + 1));
+    uint32_t equal = _mm256_movemask_epi8(_mm256_cmpeq_epi8(curr, next));
+    boundaries(i, (uint32_t)~equal);
+  }
+#elif defined(__SSE2__)
+  for(; i + 17 <= n; i += 16)
+  {
+    __m128i curr = _mm_loadu_si128((const __m128i*)(data + i));
+    __m128i next = _mm_loadu_si128((const __m128i*)(data + i + 1));
+    uint32_t equal = _mm_movemask_epi8(_mm_cmpeq_epi8(curr, next));
+    boundaries(i, (~equal) & 0xFFFF);
+  }
+#endif
+
+  for(; i + 1 < n; i++)
+  {
+    if(data[i] != data[i + 1]) { emit(data[run_start], i + 1 - run_start); run_start = i + 1; }
+  }
+  return run_start;
+}
+
+/*
+  A chunk of a plain BWT that is run-length encoded independently of the other chunks.
+*/
+struct PlainChunk
+{
+  const static size_type CHUNK_SIZE = 16 * MEGABYTE;  // Must be a multiple of 8 bytes.
+
+  std::vector<char_type> buffer;
+  size_type              size;
+  RLESegment             rle;
+  std::vector<size_type> counts;  // Does not include the tail.
+
+  PlainChunk() : buffer(CHUNK_SIZE), size(0) {}
+
+  void encode(const Alphabet& alpha)
+  {
+    this->rle.clear();
+    this->counts = std::vector<size_type>(alpha.sigma, 0);
+
+    // Different characters may have the same comp value, so the runs are combined by comp values.
+    RunBuffer run_buffer;
+    auto addRun = [&](char_type c, size_type length)
+    {
+      if(run_buffer.add(alpha.char2comp[c], length))
+      {
+        this->rle.addRun(run_buffer.run);
+        this->counts[run_buffer.run.first] += run_buffer.run.second;
+      }
+    };
+    if(this->size > 0)
+    {
+      size_type last = findRuns(this->buffer.data(), this->size, addRun);
+      addRun(this->buffer[last], this->size - last);
+    }
+    run_buffer.flush();
+    this->rle.tail = run_buffer.run;
+  }
+};
+
+/*
+  The output for a range of the run-length encoded data in a byte-based format. Short
+  repeats of the same byte are stored in the buffer, while long ones are stored as fills
+  that are expanded when writing.
+*/
+struct OutputChunk
+{
+  typedef uint8_t code_type;
+
+  const static size_type CHUNK_SIZE  = 64 * KILOBYTE;  // Bytes of run-length encoded data.
+  const static size_type MAX_LITERAL = 64;             // Longer repeats become fills.
+  const static size_type FILL_SIZE   = MEGABYTE;       // Write long fills in this many bytes.
+
+  struct Fill
+  {
+    size_type pos;    // Position in the buffer.
+    code_type value;
+    size_type count;
+  };
+
+  std::vector<code_type> buffer;
+  std::vector<Fill>      fills;
+  size_type              bytes;
+
+  OutputChunk() : bytes(0) {}
+
+  inline void add(code_type value, size_type count)
+  {
+    if(count <= MAX_LITERAL) { this->buffer.insert(this->buffer.end(), count, value); }
+    else { this->fills.push_back({ this->buffer.size(), value, count }); }
+    this->bytes += count;
+  }
+
+  void clear()
+  {
+    this->buffer.clear(); this->fills.clear(); this->bytes = 0;
+  }
+
+  void write(std::ofstream& out) const
+  {
+    size_type pos = 0;
+    std::vector<code_type> fill_buffer;
+    for(const Fill& fill : this->fills)
+    {
+      out.write((const char*)(this->buffer.data() + pos), fill.pos - pos); pos = fill.pos;
+      fill_buffer.assign(std::min(fill.count, FILL_SIZE), fill.value);
+      for(size_type remaining = fill.count; remaining > 0; )
+      {
+        size_type length = std::min(remaining, fill_buffer.size());
+        out.write((const char*)(fill_buffer.data()), length); remaining -= length;
+      }
+    }
+    out.write((const char*)(this->buffer.data() + pos), this->buffer.size() - pos);
+  }
+};
+
+/*
+  Threads encode consecutive ranges of the run-length encoded data using encoder(run, chunk),
+  while the main thread writes the output of the previous ranges. Returns the number of
+  bytes written.
+*/
+template<class Encoder>
+size_type
+writeRuns(std::ofstream& out, const BlockArray& data, const Encoder& encoder)
+{
+  size_type threads = std::max(Parallel::max_threads, (size_type)1);
+  size_type chunk_count = (data.size() + OutputChunk::CHUNK_SIZE - 1) / OutputChunk::CHUNK_SIZE;
+  std::vector<OutputChunk> chunks[2] = { std::vector<OutputChunk>(threads), std::vector<OutputChunk>(threads) };
+
+  auto encode = [&](OutputChunk& chunk, size_type chunk_id)
+  {
+    chunk.clear();
+    size_type rle_pos = chunk_id * OutputChunk::CHUNK_SIZE;
+    size_type limit = std::min(rle_pos + OutputChunk::CHUNK_SIZE, data.size());
+    while(rle_pos < limit) { encoder(Run::read(data, rle_pos), chunk); }
+  };
+
+  size_type bytes = 0;
+  std::vector<std::thread> encoders;
+  for(size_type round = 0; round * threads < chunk_count; round++)
+  {
+    std::vector<OutputChunk>& curr = chunks[round % 2];
+    size_type first = round * threads, limit = std::min(first + threads, chunk_count);
+    for(size_type i = first; i < limit; i++)
+    {
+      encoders.push_back(std::thread(encode, std::ref(curr[i - first]), i));
+    }
+
+    // Write the previous round while encoding this one.
+    if(round > 0)
+    {
+      for(const OutputChunk& chunk : chunks[(round + 1) % 2])
+      {
+        chunk.write(out); bytes += chunk.bytes;
+      }
+    }
+    for(std::thread& encoder_thread : encoders) { encoder_thread.join(); }
+    encoders.clear();
+    if(limit < chunk_count) { continue; }
+
+    for(size_type i = first; i < limit; i++)
+    {
+      curr[i - first].write(out); bytes += curr[i - first].bytes;
+    }
+  }
+
+  return bytes;
+}
+
 template<class BufferType>
 struct PlainData
 {
@@ -130,60 +328,66 @@ struct PlainData
 
   const static size_type BUFFER_SIZE = MEGABYTE;
 
+  /*
+    The main thread reads a round of chunks, and each thread run-length encodes a chunk.
+    The main thread then places the encoded chunks in the data, and the threads write them
+    in parallel. See RLESegment.
+  */
   static void read(std::ifstream& in, BlockArray& data, sdsl::int_vector<64>& counts, const Alphabet& alpha)
   {
     data.clear();
     counts = sdsl::int_vector<64>(alpha.sigma, 0);
 
     RunBuffer run_buffer;
+    ByteCounter pos(0);
     size_type bytes = BufferType::readHeader(in);
-    char_type* buffer = new char_type[BUFFER_SIZE];
-    for(size_type offset = 0; offset < bytes; offset += BUFFER_SIZE)
+    std::vector<PlainChunk> chunks(std::max(Parallel::max_threads, (size_type)1));
+    for(size_type offset = 0; offset < bytes; )
     {
-      size_type buffer_size = std::min(BUFFER_SIZE, bytes - offset);
-      BufferType::readData(in, buffer, buffer_size);
-      for(size_type i = 0; i < buffer_size; i++)
+      size_type chunk_count = 0;
+      for(; chunk_count < chunks.size() && offset < bytes; chunk_count++)
       {
-        if(run_buffer.add(buffer[i]))
-        {
-          run_buffer.run.first = alpha.char2comp[run_buffer.run.first];
-          Run::write(data, run_buffer.run);
-          counts[run_buffer.run.first] += run_buffer.run.second;
-        }
+        PlainChunk& chunk = chunks[chunk_count];
+        chunk.size = std::min(PlainChunk::CHUNK_SIZE, bytes - offset);
+        BufferType::readData(in, chunk.buffer.data(), chunk.size);
+        offset += chunk.size;
       }
+
+      std::vector<std::thread> encoders;
+      for(size_type i = 0; i < chunk_count; i++)
+      {
+        encoders.push_back(std::thread(&PlainChunk::encode, &(chunks[i]), std::cref(alpha)));
+      }
+      for(size_type i = 0; i < chunk_count; i++) { encoders[i].join(); }
+
+      for(size_type i = 0; i < chunk_count; i++)
+      {
+        PlainChunk& chunk = chunks[i];
+        for(size_type c = 0; c < alpha.sigma; c++) { counts[c] += chunk.counts[c]; }
+        counts[chunk.rle.tail.first] += chunk.rle.tail.second;
+        chunk.rle.place(run_buffer, pos);
+      }
+      data.resize(pos.size());
+
+      std::vector<std::thread> writers;
+      for(size_type i = 0; i < chunk_count; i++)
+      {
+        writers.push_back(std::thread(&RLESegment::write, &(chunks[i].rle), std::ref(data)));
+      }
+      for(size_type i = 0; i < chunk_count; i++) { writers[i].join(); }
     }
     run_buffer.flush();
-    run_buffer.run.first = alpha.char2comp[run_buffer.run.first];
     Run::write(data, run_buffer.run);
-    counts[run_buffer.run.first] += run_buffer.run.second;
-
-    delete[] buffer; buffer = 0;
   }
 
   static void write(std::ofstream& out, const BlockArray& data, const Alphabet& alpha, const NativeHeader& info)
   {
     BufferType::writeHeader(out, info.bases);
-
-    size_type rle_pos = 0, buffer_pos = 0;
-    char_type* buffer = new char_type[BUFFER_SIZE];
-    while(rle_pos < data.size())
+    size_type bytes = writeRuns(out, data, [&alpha](range_type run, OutputChunk& chunk)
     {
-      range_type run = Run::read(data, rle_pos);
-      run.first = alpha.comp2char[run.first];
-      while(run.second > 0)
-      {
-        if(buffer_pos >= BUFFER_SIZE)
-        {
-          BufferType::writeData(out, buffer, buffer_pos);
-          buffer_pos = 0;
-        }
-        size_type length = std::min(BUFFER_SIZE - buffer_pos, run.second); run.second -= length;
-        for(size_type i = 0; i < length; i++, buffer_pos++) { buffer[buffer_pos] = run.first; }
-      }
-    }
-    if(buffer_pos > 0) { BufferType::writeData(out, buffer, buffer_pos); }
-
-    delete[] buffer; buffer = 0;
+      chunk.add(alpha.comp2char[run.first], run.second);
+    });
+    BufferType::writePadding(out, bytes);
   }
 };
 
@@ -208,6 +412,8 @@ struct PlainBuffer
     out.write((const char*)data, bytes);
   }
 
+  static void writePadding(std::ofstream&, size_type) {}
+
   static void readData(std::ifstream& in, Element* data, size_type elements)
   {
     size_type bytes = elements * sizeof(Element);
@@ -309,59 +515,21 @@ struct RopeData
     counts[run_buffer.run.first] += run_buffer.run.second;
   }
 
+  /*
+    Returns the number of bytes written.
+  */
   template<class Coder>
-  static void write(std::ofstream& out, const BlockArray& data)
+  static size_type write(std::ofstream& out, const BlockArray& data)
   {
-    size_type rle_pos = 0;
-    std::vector<typename Coder::code_type> buffer; buffer.reserve(MEGABYTE);
-    while(rle_pos < data.size())
+    return writeRuns(out, data, [](range_type run, OutputChunk& chunk)
     {
-      range_type run = Run::read(data, rle_pos);
-      while(run.second > MAX_RUN)
-      {
-        buffer.push_back(Coder::encode(run.first, MAX_RUN));
-        run.second -= MAX_RUN;
-        if(buffer.size() >= MEGABYTE)
-        {
-          out.write((char*)(buffer.data()), buffer.size());
-          buffer.clear();
-        }
-      }
-      buffer.push_back(Coder::encode(run.first, run.second));
-      if(buffer.size() >= MEGABYTE)
-      {
-        out.write((char*)(buffer.data()), buffer.size());
-        buffer.clear();
-      }
-    }
-    out.write((char*)(buffer.data()), buffer.size());
+      size_type full_runs = (run.second - 1) / MAX_RUN;
+      if(full_runs > 0) { chunk.add(Coder::encode(run.first, MAX_RUN), full_runs); }
+      chunk.add(Coder::encode(run.first, run.second - full_runs * MAX_RUN), 1);
+    });
   }
-
-  static void countRuns(ParallelLoop& loop, const BlockArray& data, std::atomic<size_type>& total_runs);
 };
 
-void
-RopeData::countRuns(ParallelLoop& loop, const BlockArray& data, std::atomic<size_type>& total_runs)
-{
-  while(true)
-  {
-    range_type range = loop.next();
-    if(Range::empty(range)) { return; }
-    size_type runs = 0;
-    for(size_type block = range.first; block <= range.second; block++)
-    {
-      size_type rle_pos = block * BlockArray::BLOCK_SIZE;
-      size_type limit = std::min(data.size(), (block + 1) * BlockArray::BLOCK_SIZE);
-      while(rle_pos < limit)
-      {
-        range_type run = Run::read(data, rle_pos);
-        runs += (run.second + MAX_RUN - 1) / MAX_RUN;
-      }
-    }
-    total_runs += runs;
-  }
-}
-
 //------------------------------------------------------------------------------
 
 struct RopeCoder
@@ -431,17 +599,15 @@ SGAFormat::read(std::ifstream& in, BlockArray& data, sdsl::int_vector<64>& count
 void
 SGAFormat::write(std::ofstream& out, const BlockArray& data, const NativeHeader& info)
 {
-  std::atomic<size_type> total_runs(0);
-  {
-    ParallelLoop loop(0, data.blocks(), Parallel::max_threads, Parallel::max_threads);
-    loop.execute(RopeData::countRuns, std::ref(data), std::ref(total_runs));
-  }
-
+  // The header is written again when the number of bytes is known.
   SGAHeader header;
-  header.bases = info.bases; header.sequences = info.sequences; header.bytes = total_runs;
+  header.bases = info.bases; header.sequences = info.sequences; header.bytes = 0;
+  std::streampos header_pos = out.tellp();
   header.serialize(out);
 
-  RopeData::write<SGACoder>(out, data);
+  header.bytes = RopeData::write<SGACoder>(out, data);
+  std::streampos end_pos = out.tellp();
+  out.seekp(header_pos); header.serialize(out); out.seekp(end_pos);
 }
 
 //------------------------------------------------------------------------------
@@ -458,6 +624,44 @@ formatExists(const std::string& format)
       || (format == SGAFormat::tag);
 }
 
+size_type
+bwtLength(const std::string& filename, const std::string& format)
+{
+  std::ifstream in(filename.c_str(), std::ios_base::binary);
+  if(!in)
+  {
+    std::cerr << "bwtLength(): Cannot open input file " << filename << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+
+  size_type length = 0;
+  if(format == NativeFormat::tag)
+  {
+    NativeHeader header; header.load(in);
+    if(header.check()) { length = header.bases; }
+  }
+  else if(format == RFMFormat::tag || format == SDSLFormat::tag)
+  {
+    length = IntVectorBuffer<char_type>::readHeader(in);
+  }
+  else if(format == RopeFormat::tag)
+  {
+    length = fileSize(in) - RopeHeader::SIZE;
+  }
+  else if(format == SGAFormat::tag)
+  {
+    SGAHeader header; header.load(in);
+    if(header.check()) { length = header.bases; }
+  }
+  else
+  {
+    length = fileSize(in);
+  }
+  in.close();
+
+  return length;
+}
+
 void
 printFormats(std::ostream& stream)
 {
@@ -483,6 +687,7 @@ printFormats(std::ostream& stream)
 NativeHeader::NativeHeader() :
   tag(DEFAULT_TAG), flags(0), sequences(0), bases(0)
 {
+  this->setBlockSize(Run::BLOCK_SIZE);
 }
 
 size_type
@@ -526,10 +731,25 @@ NativeHeader::setOrder(AlphabeticOrder ao)
   this->flags |= static_cast<uint32_t>(ao) & ALPHABET_MASK;
 }
 
+size_type
+NativeHeader::blockSize() const
+{
+  size_type log_size = (this->flags & BLOCK_SIZE_MASK) >> BLOCK_SIZE_SHIFT;
+  return (log_size > 0 ? (size_type)1 << log_size : 64);
+}
+
+void
+NativeHeader::setBlockSize(size_type block_size)
+{
+  this->flags &= ~BLOCK_SIZE_MASK;
+  this->flags |= (static_cast<uint32_t>(bit_length(block_size) - 1) << BLOCK_SIZE_SHIFT) & BLOCK_SIZE_MASK;
+}
+
 std::ostream& operator<<(std::ostream& stream, const NativeHeader& header)
 {
   return stream << NativeFormat::name << ": " << header.sequences << " sequences, "
-                << header.bases << " bases, " << alphabetName(header.order()) << " alphabet";
+                << header.bases << " bases, " << alphabetName(header.order()) << " alphabet, "
+                << header.blockSize() << "-byte blocks";
 }
 
 //------------------------------------------------------------------------------
@@ -50,6 +50,8 @@ struct NativeHeader
 
   const static uint32_t DEFAULT_TAG = 0x54574221;
   const static uint32_t ALPHABET_MASK = 0xFF;
+  const static uint32_t BLOCK_SIZE_MASK = 0xFF00;  // log2 of the RLE block size; 0 means 64.
+  const static uint32_t BLOCK_SIZE_SHIFT = 8;
 
   NativeHeader();
 
@@ -59,6 +61,9 @@ struct NativeHeader
 
   AlphabeticOrder order() const;
   void setOrder(AlphabeticOrder ao);
+
+  size_type blockSize() const;
+  void setBlockSize(size_type block_size);
 };
 
 std::ostream& operator<<(std::ostream& stream, const NativeHeader& header);
@@ -159,6 +164,13 @@ struct SGAFormat
 
 bool formatExists(const std::string& format);
 
+/*
+  Returns the length of the BWT in the file without loading it. The length is read from the
+  header if the format has one; otherwise it is based on the file size. For RopeBWT, which
+  does not store the length, the result is the number of runs.
+*/
+size_type bwtLength(const std::string& filename, const std::string& format);
+
 void printFormats(std::ostream& stream);
 
 template<class Format>
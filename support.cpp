@@ -24,6 +24,7 @@
 
 #include <cstring>
 #include <sys/mman.h>
+#include <unistd.h>
 
 #include "support.h"
 
@@ -229,15 +230,20 @@ operator<<(std::ostream& stream, const Alphabet& alpha)
 BlockArray::BlockArray()
 {
   this->bytes = 0;
+  this->mapping = 0; this->mapped_bytes = 0;
 }
 
 BlockArray::BlockArray(const BlockArray& source)
 {
+  this->bytes = 0;
+  this->mapping = 0; this->mapped_bytes = 0;
   this->copy(source);
 }
 
 BlockArray::BlockArray(BlockArray&& source)
 {
+  this->bytes = 0;
+  this->mapping = 0; this->mapped_bytes = 0;
   *this = std::move(source);
 }
 
@@ -271,6 +277,8 @@ BlockArray::swap(BlockArray& source)
   {
     this->data.swap(source.data);
     std::swap(this->bytes, source.bytes);
+    std::swap(this->mapping, source.mapping);
+    std::swap(this->mapped_bytes, source.mapped_bytes);
   }
 }
 
@@ -289,6 +297,8 @@ BlockArray::operator=(BlockArray&& source)
     this->clear();
     std::swap(this->data, source.data); // The source must not delete the data.
     this->bytes = std::move(source.bytes);
+    std::swap(this->mapping, source.mapping);
+    std::swap(this->mapped_bytes, source.mapped_bytes);
   }
   return *this;
 }
@@ -309,13 +319,34 @@ BlockArray::serialize(std::ostream& out, sdsl::structure_tree_node* v, std::stri
 }
 
 void
-BlockArray::load(std::istream& in)
+BlockArray::load(std::istream& in, int fd)
 {
   this->clear();
 
   sdsl::read_member(this->bytes, in);
   size_type total_blocks = (this->bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
   this->data.reserve(total_blocks);
+
+  // The data is mapped in a single region starting at the page boundary before the data.
+  std::streamoff start = (fd >= 0 ? (std::streamoff)(in.tellg()) : -1);
+  if(start >= 0 && total_blocks > 0)
+  {
+    size_type shift = start % sysconf(_SC_PAGESIZE);
+    size_type length = shift + total_blocks * BLOCK_SIZE;
+    void* ptr = mmap(0, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, start - shift);
+    if(ptr != MAP_FAILED)
+    {
+      this->mapping = (value_type*)ptr; this->mapped_bytes = length;
+      for(size_type i = 0; i < total_blocks; i++)
+      {
+        this->data.push_back(this->mapping + shift + i * BLOCK_SIZE);
+      }
+      in.seekg(total_blocks * BLOCK_SIZE, std::ios_base::cur);
+      return;
+    }
+    std::cerr << "BlockArray::load(): Cannot map the data; reading it instead" << std::endl;
+  }
+
   for(size_type i = 0; i < total_blocks; i++)
   {
     this->allocateBlock();
@@ -332,6 +363,11 @@ BlockArray::clear()
   }
   this->data.clear();
   this->bytes = 0;
+  if(this->mapping != 0)
+  {
+    munmap((void*)(this->mapping), this->mapped_bytes);
+    this->mapping = 0; this->mapped_bytes = 0;
+  }
 }
 
 void
@@ -341,14 +377,38 @@ BlockArray::allocateBlock()
   this->data.push_back(ptr);
 }
 
+void
+BlockArray::resize(size_type n)
+{
+  size_type total_blocks = (n + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  while(this->data.size() > total_blocks) { this->clear(this->data.size() - 1); this->data.pop_back(); }
+  while(this->data.size() < total_blocks) { this->allocateBlock(); }
+  this->bytes = n;
+}
+
 void
 BlockArray::clear(size_type _block)
 {
   if(this->data[_block] == 0) { return; }
-  munmap((void*)(this->data[_block]), BLOCK_SIZE);
+  if(this->mapped(_block))
+  {
+    // The first page may be shared with the previous block, so it is kept until clear().
+    size_type page_size = sysconf(_SC_PAGESIZE);
+    size_type offset = this->data[_block] - this->mapping;
+    size_type first = (offset / page_size + 1) * page_size;
+    size_type last = std::min(((offset + BLOCK_SIZE) / page_size) * page_size, this->mapped_bytes);
+    if(first < last) { munmap((void*)(this->mapping + first), last - first); }
+  }
+  else { munmap((void*)(this->data[_block]), BLOCK_SIZE); }
   this->data[_block] = 0;
 }
 
+void
+BlockArray::willNeed() const
+{
+  if(this->mapping != 0) { madvise((void*)(this->mapping), this->mapped_bytes, MADV_WILLNEED); }
+}
+
 //------------------------------------------------------------------------------
 
 CumulativeArray::CumulativeArray()
@@ -465,6 +525,125 @@ CumulativeArray::load(std::istream& in)
 
 //------------------------------------------------------------------------------
 
+const std::string ByteCodePair::NAME = "ByteCodePair";
+const std::string GroupPairCode::NAME = "GroupPairCode";
+
+//------------------------------------------------------------------------------
+
+void
+BlockWriter::append(const BlockArray& source, size_type i)
+{
+  while(i < source.size())
+  {
+    size_type length = std::min(source.size() - i, BlockArray::BLOCK_SIZE - BlockArray::offset(i));
+    length = std::min(length, BlockArray::BLOCK_SIZE - BlockArray::offset(this->pos));
+    std::memcpy(&(this->array[this->pos]), source.pointer(i), length);
+    i += length; this->pos += length;
+  }
+}
+
+RLESegment::RLESegment() :
+  head(0, 0), tail(0, 0), head_bytes(0), run_count(0),
+  uniform(0), extra(Run::BLOCK_SIZE, 0),
+  join_start(0), body_start(0)
+{
+}
+
+void
+RLESegment::clear()
+{
+  this->data.clear();
+  this->head = range_type(0, 0); this->tail = range_type(0, 0);
+  this->head_bytes = 0; this->run_count = 0;
+  this->uniform = 0; this->extra.assign(Run::BLOCK_SIZE, 0);
+  this->joins.clear();
+  this->join_start = 0; this->body_start = 0;
+}
+
+void
+RLESegment::addRun(range_type run)
+{
+  Run::write(this->data, run);
+  if(this->run_count == 0) { this->head = run; this->head_bytes = this->data.size(); }
+  else if(run.second < Run::MAX_RUN) { this->uniform++; }
+  else
+  {
+    // The encoding only changes if the run is close to the end of the block.
+    ByteCounter basic(0); Run::write(basic, run);
+    for(size_type k = 0; k < Run::BLOCK_SIZE; k++)
+    {
+      size_type offset = (k + this->uniform + this->extra[k]) % Run::BLOCK_SIZE;
+      if(offset + basic.size() <= Run::BLOCK_SIZE) { this->extra[k] += basic.size(); continue; }
+      ByteCounter counter(offset); Run::write(counter, run);
+      this->extra[k] += counter.size() - offset;
+    }
+  }
+  this->run_count++;
+}
+
+void
+RLESegment::place(RunBuffer& run_buffer, ByteCounter& pos)
+{
+  this->joins.clear();
+  this->join_start = pos.size();
+  if(this->run_count > 0 && run_buffer.add(this->head)) { this->joins.push_back(run_buffer.run); }
+  if(this->run_count > 1)
+  {
+    run_buffer.flush(); this->joins.push_back(run_buffer.run);
+    run_buffer = RunBuffer();
+  }
+  if(this->tail.second > 0 && run_buffer.add(this->tail)) { this->joins.push_back(run_buffer.run); }
+  for(range_type run : this->joins) { Run::write(pos, run); }
+  this->body_start = pos.size();
+  if(this->run_count > 1) { pos.bytes += this->bodyBytes(pos.size()); }
+}
+
+void
+RLESegment::write(BlockArray& result)
+{
+  BlockWriter out(result, this->join_start);
+  for(range_type run : this->joins) { Run::write(out, run); }
+  if(this->run_count > 1)
+  {
+    if(out.size() % Run::BLOCK_SIZE == this->head_bytes % Run::BLOCK_SIZE)
+    {
+      out.append(this->data, this->head_bytes);
+    }
+    else
+    {
+      size_type rle_pos = this->head_bytes;
+      RunBuffer run_buffer;
+      while(rle_pos < this->data.size())
+      {
+        range_type run = Run::read(this->data, rle_pos); this->data.clearUntil(rle_pos);
+        if(run_buffer.add(run)) { Run::write(out, run_buffer.run); }
+      }
+      run_buffer.flush(); Run::write(out, run_buffer.run);
+    }
+  }
+  this->data.clear();
+}
+
+//------------------------------------------------------------------------------
+
+// The table is built by the preprocessor, so it is initialized before any static constructors.
+#define RUN_DECODE_1(x)  { (uint8_t)((x) % Run::SIGMA), (uint8_t)((x) / Run::SIGMA + 1) }
+#define RUN_DECODE_4(x)  RUN_DECODE_1(x), RUN_DECODE_1(x + 1), RUN_DECODE_1(x + 2), RUN_DECODE_1(x + 3)
+#define RUN_DECODE_16(x) RUN_DECODE_4(x), RUN_DECODE_4(x + 4), RUN_DECODE_4(x + 8), RUN_DECODE_4(x + 12)
+#define RUN_DECODE_64(x) RUN_DECODE_16(x), RUN_DECODE_16(x + 16), RUN_DECODE_16(x + 32), RUN_DECODE_16(x + 48)
+
+const Run::Code Run::DECODE[256] =
+{
+  RUN_DECODE_64(0), RUN_DECODE_64(64), RUN_DECODE_64(128), RUN_DECODE_64(192)
+};
+
+#undef RUN_DECODE_1
+#undef RUN_DECODE_4
+#undef RUN_DECODE_16
+#undef RUN_DECODE_64
+
+//------------------------------------------------------------------------------
+
 void open(RLArray<sdsl::int_vector_buffer<8>>& array, const std::string filename,
   size_type runs, size_type values)
 {
@@ -480,6 +659,7 @@ RLArray<BlockArray>::clear()
   this->data.clear();
   this->run_count = 0;
   this->value_count = 0;
+  this->samples.clear();
 }
 
 template<>
@@ -489,6 +669,7 @@ RLArray<sdsl::int_vector_buffer<8>>::clear()
   this->data.close();
   this->run_count = 0;
   this->value_count = 0;
+  this->samples.clear();
 }
 
 template<>
@@ -518,21 +699,53 @@ void
 RLIterator<BlockArray>::read()
 {
   if(this->end()) { this->run.first = ~(value_type)0; this->run.second = ~(length_type)0; return; }
-  this->run.first += ByteCode::read(this->array->data, this->ptr);
-  this->run.second = ByteCode::read(this->array->data, this->ptr);
+  value_type delta = 0;
+  RunPairCode::read(this->array->data, this->ptr, delta, this->run.second);
+  this->run.first += delta;
   this->array->data.clearUntil(this->ptr);
 }
 
 //------------------------------------------------------------------------------
 
-RankArray::RankArray()
+const std::string RankArray::MANIFEST_TAG = "bwt_merge rank array manifest";
+
+RankArray::RankArray() :
+  low(0), high(~(size_type)0), values_before(0), owner(true)
+{
+}
+
+RankArray::RankArray(const RankArray& source, size_type _low, size_type _high) :
+  filenames(source.filenames), run_counts(source.run_counts), value_counts(source.value_counts),
+  samples(source.samples),
+  low(_low), high(_high), values_before(0), owner(false)
 {
 }
 
 RankArray::~RankArray()
 {
   this->close();
-  for(size_type i = 0; i < this->filenames.size(); i++) { remove(this->filenames[i].c_str()); }
+  if(this->owner)
+  {
+    for(size_type i = 0; i < this->filenames.size(); i++) { remove(this->filenames[i].c_str()); }
+  }
+}
+
+void
+RankArray::swap(RankArray& source)
+{
+  if(this != &source)
+  {
+    this->filenames.swap(source.filenames);
+    this->run_counts.swap(source.run_counts);
+    this->value_counts.swap(source.value_counts);
+    this->samples.swap(source.samples);
+    std::swap(this->low, source.low);
+    std::swap(this->high, source.high);
+    std::swap(this->values_before, source.values_before);
+    std::swap(this->owner, source.owner);
+    this->inputs.swap(source.inputs);
+    this->iterators.swap(source.iterators);
+  }
 }
 
 void
@@ -541,16 +754,144 @@ RankArray::open()
   this->close();
   this->inputs = std::vector<array_type>(this->size());
   this->iterators = std::vector<iterator>(this->size());
+  this->values_before = 0;
 
   for(size_type i = 0; i < this->size(); i++)
   {
     bwtmerge::open(this->inputs[i], this->filenames[i], this->run_counts[i], this->value_counts[i]);
-    this->iterators[i] = iterator(this->inputs[i]);
+    if(this->low == 0 || i >= this->samples.size() || this->samples[i].empty())
+    {
+      this->iterators[i] = iterator(this->inputs[i]);
+    }
+    else
+    {
+      // Start from the last sample before the first run with value >= low.
+      const std::vector<sample_type>& file_samples = this->samples[i];
+      size_type sample = std::partition_point(file_samples.begin(), file_samples.end(),
+        [this](const sample_type& s) { return (s.prev < this->low); }) - file_samples.begin();
+      sample = (sample > 0 ? sample - 1 : 0);
+      this->iterators[i] = iterator(this->inputs[i], file_samples[sample]);
+      this->values_before += file_samples[sample].values;
+    }
+    while(!(this->iterators[i].end()) && this->iterators[i].run.first < this->low)
+    {
+      this->values_before += this->iterators[i].run.second;
+      ++(this->iterators[i]);
+    }
   }
 
   this->heapify();
 }
 
+std::vector<size_type>
+RankArray::partition(size_type parts) const
+{
+  std::vector<size_type> sample_values;
+  for(size_type i = 0; i < this->samples.size(); i++)
+  {
+    for(size_type j = 1; j < this->samples[i].size(); j++) { sample_values.push_back(this->samples[i][j].prev); }
+  }
+  sequentialSort(sample_values.begin(), sample_values.end());
+
+  std::vector<size_type> bounds(1, 0);
+  for(size_type p = 1; p < parts && !(sample_values.empty()); p++)
+  {
+    size_type value = sample_values[(p * sample_values.size()) / parts];
+    if(value > bounds.back()) { bounds.push_back(value); }
+  }
+  bounds.push_back(~(size_type)0);
+
+  return bounds;
+}
+
+void
+RankArray::writeManifest(const std::string& filename, const std::string& identity) const
+{
+  std::string temp_name = filename + ".tmp";
+  std::ofstream out(temp_name.c_str());
+  if(!out)
+  {
+    std::cerr << "RankArray::writeManifest(): Cannot open output file " << temp_name << std::endl;
+    return;
+  }
+
+  out << MANIFEST_TAG << '\n' << RunPairCode::NAME << '\n' << identity << '\n' << this->size() << '\n';
+  for(size_type i = 0; i < this->size(); i++)
+  {
+    std::ifstream file(this->filenames[i].c_str(), std::ios_base::binary);
+    if(!file)
+    {
+      std::cerr << "RankArray::writeManifest(): Cannot open temporary file " << this->filenames[i] << std::endl;
+      out.close(); remove(temp_name.c_str());
+      return;
+    }
+    out << this->filenames[i] << '\n'
+        << this->run_counts[i] << ' ' << this->value_counts[i] << ' ' << this->samples[i].size()
+        << ' ' << fileSize(file) << '\n';
+    for(const sample_type& sample : this->samples[i])
+    {
+      out << sample.runs << ' ' << sample.values << ' ' << sample.offset << ' ' << sample.prev << '\n';
+    }
+  }
+  out.close();
+
+  if(!out || std::rename(temp_name.c_str(), filename.c_str()) != 0)
+  {
+    std::cerr << "RankArray::writeManifest(): Cannot write manifest " << filename << std::endl;
+    remove(temp_name.c_str());
+  }
+}
+
+bool
+RankArray::readManifest(const std::string& filename, const std::string& identity)
+{
+  std::ifstream in(filename.c_str());
+  if(!in) { return false; }
+
+  std::string tag, encoding, inputs;
+  size_type files = 0;
+  if(!std::getline(in, tag) || tag != MANIFEST_TAG) { return false; }
+  if(!std::getline(in, encoding) || encoding != RunPairCode::NAME)
+  {
+    std::cerr << "RankArray::readManifest(): Ignoring " << filename << ": Run encoding " << encoding << std::endl;
+    return false;
+  }
+  if(!std::getline(in, inputs) || inputs != identity)
+  {
+    std::cerr << "RankArray::readManifest(): Ignoring " << filename << ": Different inputs" << std::endl;
+    return false;
+  }
+  if(!(in >> files)) { return false; }
+
+  RankArray temp;
+  temp.owner = false; // Do not delete the files if the manifest is invalid.
+  for(size_type i = 0; i < files; i++)
+  {
+    std::string name;
+    size_type runs = 0, values = 0, sample_count = 0, bytes = 0;
+    in >> std::ws;
+    if(!std::getline(in, name) || !(in >> runs >> values >> sample_count >> bytes)) { return false; }
+    std::ifstream test(name.c_str(), std::ios_base::binary);
+    if(!test || fileSize(test) != bytes)
+    {
+      std::cerr << "RankArray::readManifest(): Ignoring " << filename << ": Missing or truncated file " << name << std::endl;
+      return false;
+    }
+    temp.filenames.push_back(name);
+    temp.run_counts.push_back(runs);
+    temp.value_counts.push_back(values);
+    temp.samples.push_back(std::vector<sample_type>(sample_count));
+    for(sample_type& sample : temp.samples.back())
+    {
+      if(!(in >> sample.runs >> sample.values >> sample.offset >> sample.prev)) { return false; }
+    }
+  }
+
+  temp.owner = this->owner;
+  this->swap(temp);
+  return true;
+}
+
 void
 RankArray::close()
 {
@@ -114,6 +114,12 @@ public:
   void allocateBlock();
   void clear(size_type _block);
 
+  /*
+    Sets the size to n bytes. New bytes are zero, and their pages use memory only when
+    written.
+  */
+  void resize(size_type n);
+
   /*
     Removes the block before block(i).
   */
@@ -132,6 +138,18 @@ public:
     return this->data[block(i)][offset(i)];
   }
 
+  // The bytes are contiguous until the end of the block containing byte i.
+  inline const value_type* pointer(size_type i) const
+  {
+    return this->data[block(i)] + offset(i);
+  }
+
+  // Hints that the cache line containing byte i will be needed soon.
+  inline void prefetch(size_type i) const
+  {
+    if(i < this->size()) { __builtin_prefetch(this->data[block(i)] + offset(i)); }
+  }
+
   inline void push_back(value_type value)
   {
     if(offset(this->bytes) == 0) { this->allocateBlock(); }
@@ -140,10 +158,25 @@ public:
   }
 
   size_type serialize(std::ostream& out, sdsl::structure_tree_node* v = nullptr, std::string name = "") const;
-  void load(std::istream& in);
+
+  /*
+    If fd is a file descriptor for the file being read, the blocks are memory-mapped from
+    the file instead of being read. The mapping is private, so the file is never modified.
+  */
+  void load(std::istream& in, int fd = -1);
+
+  // Asks the kernel to start reading the mapped data in the background.
+  void willNeed() const;
+
+  inline bool mapped(size_type _block) const
+  {
+    return (this->data[_block] >= this->mapping && this->data[_block] < this->mapping + this->mapped_bytes);
+  }
 
   std::vector<value_type*> data;
   size_type                bytes;
+  value_type*              mapping;  // The data mapped from a file, if any.
+  size_type                mapped_bytes;
 
 private:
   void copy(const BlockArray& source);
@@ -215,16 +248,126 @@ struct ByteCode
 //------------------------------------------------------------------------------
 
 /*
-  A run in BWT.
+  Encodings for the (delta, length) pairs stored in RLArray. ByteCodePair encodes both
+  values with ByteCode. GroupPairCode writes a tag byte containing the byte lengths of both
+  values, followed by the values in little-endian byte order. With BlockArray, a pair can
+  then be decoded with two unaligned 64-bit loads and masks instead of a loop over the bytes.
+
+  RLArray and the temporary files of RankArray use GroupPairCode if GROUP_VARINT_RUNS is
+  defined and ByteCodePair otherwise.
 */
 
+struct ByteCodePair
+{
+  typedef bwtmerge::size_type value_type;
+
+  const static std::string NAME;
+
+  template<class ByteArray>
+  inline static void read(ByteArray& array, size_type& i, value_type& first, value_type& second)
+  {
+    first = ByteCode::read(array, i);
+    second = ByteCode::read(array, i);
+  }
+
+  template<class ByteArray>
+  inline static void write(ByteArray& array, value_type first, value_type second)
+  {
+    ByteCode::write(array, first);
+    ByteCode::write(array, second);
+  }
+};
+
+struct GroupPairCode
+{
+  typedef bwtmerge::size_type    value_type;
+  typedef BlockArray::value_type code_type;
+
+  const static std::string NAME;
+
+  const static size_type LENGTH_BITS = 3;
+  const static code_type LENGTH_MASK = 0x07;
+  const static size_type MAX_BYTES   = 1 + 2 * sizeof(value_type);
+
+  inline static size_type byteLength(value_type value)
+  {
+    return (value > 0 ? (bit_length(value) + 7) / 8 : 1);
+  }
+
+  inline static value_type mask(size_type bytes)
+  {
+    return (bytes >= sizeof(value_type) ? ~(value_type)0 : ((value_type)1 << (8 * bytes)) - 1);
+  }
+
+  template<class ByteArray>
+  inline static void read(ByteArray& array, size_type& i, value_type& first, value_type& second)
+  {
+    code_type tag = array[i]; i++;
+    size_type first_bytes = (tag & LENGTH_MASK) + 1, second_bytes = ((tag >> LENGTH_BITS) & LENGTH_MASK) + 1;
+    first = 0; second = 0;
+    for(size_type j = 0; j < first_bytes; j++, i++) { first |= ((value_type)(code_type)array[i]) << (8 * j); }
+    for(size_type j = 0; j < second_bytes; j++, i++) { second |= ((value_type)(code_type)array[i]) << (8 * j); }
+  }
+
+  /*
+    The fast path reads up to 16 bytes past the tag. BlockArray allocates full blocks, so
+    this is safe whenever the pair does not cross a block boundary.
+  */
+  inline static void read(const BlockArray& array, size_type& i, value_type& first, value_type& second)
+  {
+    if(BlockArray::offset(i) + MAX_BYTES > BlockArray::BLOCK_SIZE)
+    {
+      read<const BlockArray>(array, i, first, second);
+      return;
+    }
+
+    const code_type* ptr = array.data[BlockArray::block(i)] + BlockArray::offset(i);
+    size_type first_bytes = (*ptr & LENGTH_MASK) + 1, second_bytes = ((*ptr >> LENGTH_BITS) & LENGTH_MASK) + 1;
+    std::memcpy(&first, ptr + 1, sizeof(value_type)); first &= mask(first_bytes);
+    std::memcpy(&second, ptr + 1 + first_bytes, sizeof(value_type)); second &= mask(second_bytes);
+    i += 1 + first_bytes + second_bytes;
+  }
+
+  inline static void read(BlockArray& array, size_type& i, value_type& first, value_type& second)
+  {
+    read(static_cast<const BlockArray&>(array), i, first, second);
+  }
+
+  template<class ByteArray>
+  inline static void write(ByteArray& array, value_type first, value_type second)
+  {
+    size_type first_bytes = byteLength(first), second_bytes = byteLength(second);
+    array.push_back((first_bytes - 1) | ((second_bytes - 1) << LENGTH_BITS));
+    for(size_type j = 0; j < first_bytes; j++) { array.push_back(first & 0xFF); first >>= 8; }
+    for(size_type j = 0; j < second_bytes; j++) { array.push_back(second & 0xFF); second >>= 8; }
+  }
+};
+
+#ifdef GROUP_VARINT_RUNS
+typedef GroupPairCode RunPairCode;
+#else
+typedef ByteCodePair  RunPairCode;
+#endif
+
+//------------------------------------------------------------------------------
+
+/*
+  A run in BWT. The size of the RLE blocks is a compile-time parameter (see the Makefile),
+  so the block scans are specialized for it. Larger blocks make the BWT slightly smaller
+  and the queries slower.
+*/
+
+#ifndef RLE_BLOCK_SIZE
+#define RLE_BLOCK_SIZE 64
+#endif
+
 struct Run
 {
   typedef bwtmerge::comp_type    comp_type;
   typedef bwtmerge::size_type    length_type;
   typedef BlockArray::value_type code_type;
 
-  const static size_type   BLOCK_SIZE = 64; // No run can continue past a block boundary.
+  const static size_type   BLOCK_SIZE = RLE_BLOCK_SIZE; // No run can continue past a block boundary.
   const static size_type   SIGMA      = 6;
   const static length_type MAX_RUN    = 256 / SIGMA;  // 42; encoded as 6 * 41
 
@@ -233,9 +376,19 @@ struct Run
     return comp + SIGMA * (length - 1);
   }
 
+  /*
+    Decoding table for the basic byte. Replacing the division and the modulo with a table
+    lookup shortens the dependency chain when scanning a block run by run.
+  */
+  struct Code
+  {
+    uint8_t comp, length;
+  };
+  const static Code DECODE[256];
+
   inline static range_type decodeBasic(code_type code)
   {
-    return range_type(code % SIGMA, code / SIGMA + 1);
+    return range_type(DECODE[code].comp, DECODE[code].length);
   }
 
   /*
@@ -285,6 +438,86 @@ struct Run
   inline static void write(ByteArray& array, range_type run) { write(array, run.first, run.second); }
 };
 
+static_assert(Run::BLOCK_SIZE >= 32 && Run::BLOCK_SIZE <= 256 && (Run::BLOCK_SIZE & (Run::BLOCK_SIZE - 1)) == 0,
+  "RLE_BLOCK_SIZE must be 32, 64, 128, or 256");
+
+//------------------------------------------------------------------------------
+
+/*
+  Byte arrays for Run::write(). ByteCounter only counts the bytes, while BlockWriter writes
+  them to a BlockArray that has already been resized. Both start from the given position,
+  which determines where the runs are split at RLE block boundaries.
+*/
+struct ByteCounter
+{
+  size_type bytes;
+
+  explicit ByteCounter(size_type start) : bytes(start) {}
+
+  inline size_type size() const { return this->bytes; }
+  inline void push_back(byte_type) { this->bytes++; }
+};
+
+struct BlockWriter
+{
+  BlockArray& array;
+  size_type   pos;
+
+  BlockWriter(BlockArray& _array, size_type start) : array(_array), pos(start) {}
+
+  inline size_type size() const { return this->pos; }
+  inline void push_back(byte_type value) { this->array[this->pos] = value; this->pos++; }
+
+  // Copies the source from position i onwards.
+  void append(const BlockArray& source, size_type i);
+};
+
+/*
+  A part of a run-length encoded sequence, encoded independently starting from an RLE
+  block boundary and appended to the result later. The last run is kept separately, as it
+  may continue in the next segment, and the first run may merge with the previous segment.
+
+  The encoding of a long run depends on its offset within the RLE block, so the segment
+  must be re-encoded if its offset changes. To avoid a serial re-encoding pass, addRun()
+  also computes the encoded size of the runs after the first one for every starting offset.
+  place() then determines the position of the segment in the result in constant time, and
+  write() writes the segment to the result after it has been resized. Different segments
+  can be written in parallel. A segment is copied if its offset within the block does not
+  change.
+*/
+struct RLESegment
+{
+  BlockArray data;
+  range_type head, tail;
+  size_type  head_bytes, run_count;
+
+  // The runs after the first one take uniform + extra[k] bytes when starting from offset k.
+  size_type              uniform;
+  std::vector<size_type> extra;
+
+  // The runs written before the rest of the data, and their positions in the result.
+  std::vector<range_type> joins;
+  size_type               join_start, body_start;
+
+  RLESegment();
+
+  void clear();
+  void addRun(range_type run);
+
+  inline size_type bodyBytes(size_type pos) const
+  {
+    return this->uniform + this->extra[pos % Run::BLOCK_SIZE];
+  }
+
+  /*
+    Places the segment after the previous segments. The run buffer contains the last run
+    of the previous segments, and pos is the position after the runs written before it.
+  */
+  void place(RunBuffer& run_buffer, ByteCounter& pos);
+
+  void write(BlockArray& result);
+};
+
 //------------------------------------------------------------------------------
 
 /*
@@ -393,6 +626,17 @@ private:
 template<class ByteArray>
 class RLIterator;
 
+/*
+  A sample allows starting the decoding of an RLArray from the middle. It contains the
+  number of runs and values before the sample point, the offset in the data, and the value
+  of the previous run.
+*/
+struct RLSample
+{
+  size_type runs, values, offset;
+  size_type prev;
+};
+
 template<class ByteArray>
 class RLArray
 {
@@ -404,6 +648,10 @@ public:
 
   typedef RLIterator<ByteArray> iterator;
 
+  typedef RLSample sample_type;
+
+  const static size_type SAMPLE_RATE = 4096;  // Runs.
+
   RLArray() { this->run_count = 0; this->value_count = 0; }
   RLArray(const RLArray& source) { this->copy(source); }
   RLArray(RLArray&& source) { *this = std::move(source); }
@@ -418,7 +666,7 @@ public:
     this->run_count = 0; this->value_count = 0;
     if(source.empty()) { return; }
 
-    sequentialSort(source.begin(), source.end());
+    radixSort(source.begin(), source.end());
     value_type prev = 0;
     RunBuffer run_buffer;
     for(size_type i = 0; i < source.size(); i++)
@@ -459,6 +707,7 @@ public:
       this->data.swap(source.data);
       std::swap(this->run_count, source.run_count);
       std::swap(this->value_count, source.value_count);
+      this->samples.swap(source.samples);
     }
   }
 
@@ -476,6 +725,7 @@ public:
       this->data = std::move(source.data);
       this->run_count = std::move(source.run_count);
       this->value_count = std::move(source.value_count);
+      this->samples = std::move(source.samples);
     }
     return *this;
   }
@@ -488,6 +738,7 @@ public:
   void clear()
   {
     this->run_count = this->value_count = 0;
+    this->samples.clear();
   }
 
   void write(const std::string& filename)
@@ -497,8 +748,24 @@ public:
     out.close();
   }
 
+  /*
+    Appends a run to the array. The value of the run must be at least prev, which should
+    be the value of the previous run or 0 for the first run.
+  */
+  inline void addRun(run_type run, value_type& prev)
+  {
+    if(this->run_count % SAMPLE_RATE == 0)
+    {
+      sample_type sample = { this->run_count, this->value_count, this->data.size(), prev };
+      this->samples.push_back(sample);
+    }
+    RunPairCode::write(this->data, run.first - prev, run.second); prev = run.first;
+    this->run_count++; this->value_count += run.second;
+  }
+
   ByteArray data;
   size_type run_count, value_count;
+  std::vector<sample_type> samples;
 
 private:
   void copy(const RLArray& source)
@@ -506,13 +773,7 @@ private:
     this->data = source.data;
     this->run_count = source.run_count;
     this->value_count = source.value_count;
-  }
-
-  inline void addRun(run_type run, value_type& prev)
-  {
-    ByteCode::write(this->data, run.first - prev); prev = run.first;
-    ByteCode::write(this->data, run.second);
-    this->run_count++; this->value_count += run.second;
+    this->samples = source.samples;
   }
 };  // class RLArray
 
@@ -545,11 +806,24 @@ public:
     this->read();
   }
 
+  // Starts decoding from the sample point.
+  inline RLIterator(RLArray<ByteArray>& _array, const typename RLArray<ByteArray>::sample_type& sample) :
+    array(&_array), pos(sample.runs), ptr(sample.offset), run(sample.prev, 0)
+  {
+    this->read();
+  }
+
   inline RLIterator(const RLIterator& source) :
     array(source.array), pos(source.pos), ptr(source.ptr), run(source.run)
   {
   }
 
+  inline RLIterator& operator= (const RLIterator& source)
+  {
+    this->array = source.array; this->pos = source.pos; this->ptr = source.ptr; this->run = source.run;
+    return *this;
+  }
+
   inline run_type operator* () const { return this->run; }
   inline run_type* operator-> () { return &(this->run); }
   inline void operator++ () { this->pos++; this->read(); }
@@ -563,8 +837,9 @@ private:
   inline void read()
   {
     if(this->end()) { this->run.first = ~(value_type)0; this->run.second = ~(length_type)0; return; }
-    this->run.first += ByteCode::read(this->array->data, this->ptr);
-    this->run.second = ByteCode::read(this->array->data, this->ptr);
+    value_type delta = 0;
+    RunPairCode::read(this->array->data, this->ptr, delta, this->run.second);
+    this->run.first += delta;
   }
 };  // class RLIterator
 
@@ -579,23 +854,55 @@ public:
   typedef RLArray<sdsl::int_vector_buffer<8>> array_type;
   typedef array_type::run_type                run_type;
   typedef array_type::iterator                iterator;
+  typedef array_type::sample_type             sample_type;
+
+  const static std::string MANIFEST_TAG;
 
   RankArray();
   ~RankArray();
 
+  /*
+    Creates a view of the runs with low <= value < high in the source. The view shares the
+    files with the source, and it can be iterated over concurrently with other views.
+  */
+  RankArray(const RankArray& source, size_type low, size_type high);
+
+  void swap(RankArray& source);
+
   void open();
   void close();
 
+  /*
+    Returns the boundaries of at most parts value ranges with approximately the same
+    number of runs. The first boundary is 0 and the last one is ~0.
+  */
+  std::vector<size_type> partition(size_type parts) const;
+
+  /*
+    A manifest lists the temporary files of a complete rank array, allowing it to be reused
+    if the merge is restarted. The manifest is written to a temporary file that is renamed
+    when complete. It records the identity of the inputs, the RunPairCode variant, and the
+    size of each file. readManifest() returns false if any of them does not match or if the
+    manifest or any of the files cannot be read.
+  */
+  void writeManifest(const std::string& filename, const std::string& identity) const;
+  bool readManifest(const std::string& filename, const std::string& identity);
+
   /*
     Iterator operations.
   */
   inline run_type operator* () const { return *(this->iterators[0]); }
   inline void operator++ () { ++(this->iterators[0]); this->down(0); }
-  inline bool end() const { return this->iterators[0].end(); }
+  inline bool end() const { return (this->iterators[0].end() || this->iterators[0].run.first >= this->high); }
 
   std::vector<std::string> filenames;
   std::vector<size_type>   run_counts;
   std::vector<size_type>   value_counts;
+  std::vector<std::vector<sample_type>> samples;
+
+  size_type low, high;
+  size_type values_before;  // Values in the runs before low; set by open().
+  bool      owner;          // Delete the files in the destructor.
 
   std::vector<array_type> inputs;
   std::vector<iterator>   iterators;
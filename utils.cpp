@@ -95,6 +95,15 @@ memoryUsage()
 #endif
 }
 
+size_type
+residentMemory()
+{
+  std::ifstream statm("/proc/self/statm");
+  size_type total = 0, resident = 0;
+  if(statm >> total >> resident) { return resident * sysconf(_SC_PAGESIZE); }
+  return memoryUsage();
+}
+
 //------------------------------------------------------------------------------
 
 size_type
@@ -127,10 +136,18 @@ tempFile(const std::string& name_part)
   char hostname[32];
   gethostname(hostname, 32); hostname[31] = 0;
 
+  // sdsl::util::id() is not thread-safe, and concurrent merges may create temporary files.
+  static std::mutex id_lock;
+  size_type id = 0;
+  {
+    std::lock_guard<std::mutex> lock(id_lock);
+    id = sdsl::util::id();
+  }
+
   return name_part + '_'
     + std::string(hostname) + '_'
     + sdsl::util::to_string(sdsl::util::pid()) + '_'
-    + sdsl::util::to_string(sdsl::util::id());
+    + sdsl::util::to_string(id);
 }
 
 size_type
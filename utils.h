@@ -28,6 +28,7 @@
 #include <algorithm>
 #include <atomic>
 #include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <mutex>
@@ -214,6 +215,7 @@ void tokenize(const std::string& source, std::vector<std::string>& tokens, char
 
 double readTimer();       // Seconds from an arbitrary time point.
 size_type memoryUsage();  // Peak memory usage in bytes.
+size_type residentMemory();  // Current memory usage in bytes; peak usage if not available.
 
 //------------------------------------------------------------------------------
 
@@ -249,6 +251,71 @@ sequentialSort(Iterator first, Iterator last)
 #endif
 }
 
+/*
+  In-place MSD radix sort (American flag sort) for unsigned integers and for pairs with an
+  unsigned integer as the first component. Pairs are sorted by the first component only, and
+  the relative order of pairs with equal first components is unspecified. Buckets smaller
+  than RADIX_SORT_THRESHOLD elements are sorted with std::sort.
+*/
+const size_type RADIX_SORT_THRESHOLD = 64;
+const size_type RADIX_SORT_BITS      = 8;
+
+inline size_type radixKey(size_type value) { return value; }
+
+template<class A, class B>
+inline size_type radixKey(const std::pair<A, B>& value) { return value.first; }
+
+template<class Iterator>
+void
+radixSort(Iterator first, Iterator last, size_type shift)
+{
+  typedef typename std::iterator_traits<Iterator>::value_type element_type;
+  const size_type BUCKETS = (size_type)1 << RADIX_SORT_BITS, MASK = BUCKETS - 1;
+
+  if((size_type)(last - first) <= RADIX_SORT_THRESHOLD)
+  {
+    sequentialSort(first, last, [](const element_type& a, const element_type& b)
+    {
+      return (radixKey(a) < radixKey(b));
+    });
+    return;
+  }
+
+  size_type counts[BUCKETS] = {}, next[BUCKETS], limits[BUCKETS];
+  for(Iterator iter = first; iter != last; ++iter) { counts[(radixKey(*iter) >> shift) & MASK]++; }
+  for(size_type b = 0, offset = 0; b < BUCKETS; b++)
+  {
+    next[b] = offset; offset += counts[b]; limits[b] = offset;
+  }
+
+  // Move each element to its bucket by following the permutation cycles.
+  for(size_type b = 0; b < BUCKETS; b++)
+  {
+    while(next[b] < limits[b])
+    {
+      size_type digit = (radixKey(first[next[b]]) >> shift) & MASK;
+      if(digit == b) { next[b]++; }
+      else { std::swap(first[next[b]], first[next[digit]]); next[digit]++; }
+    }
+  }
+
+  if(shift == 0) { return; }
+  for(size_type b = 0, offset = 0; b < BUCKETS; offset += counts[b], b++)
+  {
+    if(counts[b] > 1) { radixSort(first + offset, first + offset + counts[b], shift - RADIX_SORT_BITS); }
+  }
+}
+
+template<class Iterator>
+void
+radixSort(Iterator first, Iterator last)
+{
+  size_type max_key = 0;
+  for(Iterator iter = first; iter != last; ++iter) { max_key = std::max(max_key, radixKey(*iter)); }
+  size_type bits = (max_key > 0 ? bit_length(max_key) : 1);
+  radixSort(first, last, ((bits - 1) / RADIX_SORT_BITS) * RADIX_SORT_BITS);
+}
+
 //------------------------------------------------------------------------------
 
 struct Parallel
@@ -404,6 +471,13 @@ struct IntVectorBuffer
     if(bytes % sizeof(code_type) != 0) { bytes += sizeof(code_type) - bytes % sizeof(code_type); }
     in.read((char*)data, bytes);
   }
+
+  // Pads the data written with plain writes to a multiple of code_type.
+  static void writePadding(std::ofstream& out, size_type elements)
+  {
+    size_type bytes = elements * sizeof(Element);
+    for(; bytes % sizeof(code_type) != 0; bytes++) { out.put(0); }
+  }
 };
 
 /*